@@ -1,3 +1,15 @@
+struct ball
+{
+    float vx;
+#if HSHG_D >= 2
+    float vy;
+#endif
+#if HSHG_D >= 3
+    float vz;
+#endif
+};
+
+#define hshg_user_t struct ball
 #define HSHG_UNIFORM
 #include "hshg.c"
 
@@ -35,56 +47,10 @@ decrease this for more frequent output. */
 #define SINGLE_LAYER 1
 
 
-struct ball
-{
-    float vx;
-_2D(float vy;)
-_3D(float vz;)
-};
-
-struct ball* balls = NULL;
-struct ball* ball = 0;
-struct ball* balls_new = NULL;
-hshg_entity_t ball_idx = 0;
-
-
-void
-balls_update(struct hshg* hshg, struct hshg_entity* a)
-{
-    *ball = balls[a->ref];
-    a->ref = ball_idx;
-    ++ball;
-    ++ball_idx;
-}
-
-
-void
-balls_optimize(struct hshg* hshg)
-{
-    balls_new = calloc(AGENTS_NUM, sizeof(*balls_new));
-
-    assert(balls_new);
-
-    ball_idx = 0;
-    ball = balls_new;
-
-    hshg_update_t old = hshg->update;
-
-    hshg->update = balls_update;
-
-    hshg_update(hshg);
-
-    free(balls);
-
-    balls = balls_new;
-    hshg->update = old;
-}
-
-
 void
 update(struct hshg* hshg, struct hshg_entity* a)
 {
-    struct ball* const ball = balls + a->ref;
+    struct ball* const ball = &a->user;
 
     a->x += ball->vx;
 
@@ -170,8 +136,9 @@ _3D(float dz = a->z - b->z;)
         ++collisions;
         const float mag = inv_sqrt(dist);
 
-        struct ball* const ball_a = balls + a->ref;
-        struct ball* const ball_b = balls + b->ref;
+        /* Only user data may be written from here, see hshg_collide_t */
+        struct ball* const ball_a = (struct ball*) &a->user;
+        struct ball* const ball_b = (struct ball*) &b->user;
 
         dx *= mag;
     _2D(dy *= mag;)
@@ -245,7 +212,7 @@ main()
     srand(get_time());
     signal(SIGINT, sighandler);
 
-    balls = calloc(AGENTS_NUM, sizeof(*balls));
+    struct ball* balls = calloc(AGENTS_NUM, sizeof(*balls));
 
     assert(balls);
 
@@ -309,10 +276,13 @@ main()
         assert(
             !hshg_insert(hshg,
                 init_data[i * mul + 0] _2D(, init_data[i * mul + 2])
-                _3D(, init_data[i * mul + 3]), init_data[i * mul + 1], i)
+                _3D(, init_data[i * mul + 3]), init_data[i * mul + 1], i,
+                balls[i])
         );
     }
 
+    free(balls);
+
     const uint64_t ins_end_time = get_time();
 
     printf("took %" PRIu64 "ms to insert %d entities\n%" PRIu8 " grids\n\n",
@@ -332,8 +302,6 @@ main()
 
         assert(!hshg_optimize(hshg));
 
-        balls_optimize(hshg);
-
         const uint64_t col_time = get_time();
 
         hshg_collide(hshg);
@@ -20,13 +20,25 @@
 #define NDEBUG
 #endif
 
+#ifdef HSHG_HUGEPAGES
+#include <sys/mman.h>
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#endif
+
 extern void* malloc(size_t);
 extern void  free(void*);
 extern void* calloc(size_t, size_t);
 extern void* realloc(void*, size_t);
+extern void* aligned_alloc(size_t, size_t);
 
 extern float fabsf(float);
+extern double fabs(double);
+extern long double fabsl(long double);
 extern void* memcpy(void*, const void*, size_t);
+extern void* memset(void*, int, size_t);
 
 #ifdef HSHG_NDEBUG
 #define hshg_set(prop, to)
@@ -65,856 +77,4440 @@ static const _hshg_cell_sq_t _hshg_cell_sq_max = max_t(_hshg_cell_sq_t);
 
 #undef max_t
 
+/*
+ * The biggest value the cell of an entity can hold, used to mark it invalid.
+ */
+static const _hshg_cell_sq_t _hshg_cell_invalid =
+    _hshg_cell_sq_max _HSHG_COMPACT(>> (5 _HSHG_SLEEP(+ 1)));
 
-hshg_attrib_const
-static uint8_t
-hshg_max_grids(_hshg_cell_t side)
+/*
+ * Alignment of everything besides entities and cells, which is no more than
+ * what malloc() guarantees anyway.
+ */
+#define hshg_align _Alignof(max_align_t)
+
+
+/*
+ * Only alignments bigger than what malloc() guarantees need aligned_alloc(),
+ * which wants the size to be a multiple of the alignment.
+ */
+static void*
+hshg_libc_malloc(void* const ctx, const size_t size, const size_t align)
 {
-    uint8_t grids_len = 0;
+    (void) ctx;
 
-    do
+    if(align <= hshg_align)
     {
-        ++grids_len;
-        side >>= 1;
+        return malloc(size);
     }
-    while(side >= 2);
 
-    return grids_len;
+    return aligned_alloc(align, (size + align - 1) & ~(align - 1));
 }
 
 
-hshg_attrib_const
-static hshg_cell_sq_t
-hshg_max_cells(_hshg_cell_t side)
+static void*
+hshg_libc_calloc(void* const ctx, const size_t size, const size_t align)
 {
-    _hshg_cell_sq_t cells_len = 0;
-
-    do
+    if(align <= hshg_align)
     {
-        const _hshg_cell_sq_t new = cells_len +
-            (_hshg_cell_sq_t) side _2D(* side) _3D(* side);
+        return calloc(1, size);
+    }
 
-        assert(new > cells_len &&
-            "_hshg_cell_sq_t must be set to a wider data type");
+    void* const ptr = hshg_libc_malloc(ctx, size, align);
 
-        cells_len = new;
-        side >>= 1;
+    if(ptr != NULL)
+    {
+        (void) memset(ptr, 0, size);
     }
-    while(side >= 2);
 
-    return cells_len;
+    return ptr;
 }
 
 
-_hshg*
-_hshg_create(const _hshg_cell_t side, const uint32_t size)
+/*
+ * realloc() doesn't know about alignments, and the old size isn't known here,
+ * so memory that realloc() moved to a wrong place is copied once more, into
+ * memory allocated beforehand so that the old memory survives any failure.
+ */
+static void*
+hshg_libc_realloc(void* const ctx, void* const ptr,
+    const size_t size, const size_t align)
 {
-    assert(__builtin_popcount(side) == 1 &&
-        "Both arguments must be powers of 2");
-    assert(__builtin_popcount(size) == 1 &&
-        "Both arguments must be powers of 2");
-
-    const _hshg_cell_sq_t cells_len = hshg_max_cells(side);
-    const uint8_t grids_len = hshg_max_grids(side);
-
-    _hshg* const hshg =
-        malloc(sizeof(_hshg) + sizeof(_hshg_grid) * grids_len);
+    if(align <= hshg_align)
+    {
+        return realloc(ptr, size);
+    }
 
-    if(hshg == NULL)
+    if(ptr == NULL)
     {
-        goto err;
+        return hshg_libc_malloc(ctx, size, align);
     }
 
-    _hshg_entity_t* const cells = calloc(cells_len, sizeof(_hshg_entity_t));
+    void* const aligned = hshg_libc_malloc(ctx, size, align);
 
-    if(cells == NULL)
+    if(aligned == NULL)
     {
-        goto err_hshg;
+        return NULL;
     }
 
-    const _hshg_cell_sq_t grid_size = (_hshg_cell_sq_t) side * size;
+    void* const new_ptr = realloc(ptr, size);
 
-    (void) memcpy(hshg, &(
-    (_hshg)
+    if(new_ptr == NULL || ((uintptr_t) new_ptr & (align - 1)) == 0)
     {
-        .entities = NULL,
-        .cells = cells,
+        free(aligned);
 
-        .update = NULL,
-        .collide = NULL,
-        .query = NULL,
+        return new_ptr;
+    }
 
-        .cell_log = 31 - __builtin_ctz(size),
-        .grids_len = grids_len,
+    (void) memcpy(aligned, new_ptr, size);
+    free(new_ptr);
 
-        .calling = 0,
-        .removed = 0,
+    return aligned;
+}
 
-        .old_cache = 0,
-        .new_cache = 0,
 
-        .grid_size = grid_size,
-        .inverse_grid_size = (_hshg_pos_t) 1.0 / grid_size,
-        .cells_len = cells_len,
-        .cell_size = size,
+static void
+hshg_libc_free(void* const ctx, void* const ptr)
+{
+    (void) ctx;
 
-        .free_entity = 0,
-        .entities_used = 1,
-        .entities_size = 1,
-        .entity_id = 0
-    }
-    ), sizeof(_hshg));
+    free(ptr);
+}
 
-    _hshg_entity_t idx = 0;
-    uint32_t _size = size;
 
-    _hshg_cell_t _side = side;
+const _hshg_allocator _hshg_libc_allocator =
+{
+    .ctx = NULL,
+    .malloc = hshg_libc_malloc,
+    .calloc = hshg_libc_calloc,
+    .realloc = hshg_libc_realloc,
+    .free = hshg_libc_free
+};
 
-    for(uint8_t i = 0; i < grids_len; ++i)
-    {
-        (void) memcpy(hshg->grids + i, &(
-        (_hshg_grid)
-        {
-            .cells = hshg->cells + idx,
 
-            .cells_side = _side,
-        _3D(.cells_sq = (_hshg_cell_sq_t) _side * _side,)
-            .cells_mask = _side - 1,
+#ifdef HSHG_HUGEPAGES
+
+/*
+ * Every block starts with a header as big as the alignment, the last two words
+ * of which are the number of usable bytes and the size of the header, with the
+ * lowest bit set if the block was mapped rather than allocated. Blocks grow in
+ * place if the usable bytes suffice. Mapped blocks give whole huge pages back
+ * when they shrink, others never shrink.
+ */
+
+hshg_attrib_always_inline
+static inline size_t*
+hshg_hugepage_header(void* const ptr)
+{
+    return (size_t*) ptr - 2;
+}
 
-        _2D(.cells2d_log = __builtin_ctz(_side) << 0,)
-        _3D(.cells3d_log = __builtin_ctz(_side) << 1,)
 
-            .shift = 0,
+hshg_attrib_const
+static size_t
+hshg_hugepage_round(const size_t len)
+{
+    return (len + HSHG_HUGEPAGE_SIZE - 1) & ~(HSHG_HUGEPAGE_SIZE - 1);
+}
 
-            .inverse_cell_size = (_hshg_pos_t) 1.0 / _size,
 
-            .entities_len = 0
-        }
-        ), sizeof(_hshg_grid));
+/*
+ * Mappings are only aligned to normal pages, so one huge page more is mapped,
+ * and whatever is left around the aligned part is unmapped right away, so that
+ * huge pages can back all of it.
+ */
+static uint8_t*
+hshg_hugepage_map(const size_t len)
+{
+    uint8_t* const base = mmap(NULL, len + HSHG_HUGEPAGE_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-        idx += (_hshg_cell_sq_t) _side _2D(* _side) _3D(* _side);
-        _side >>= 1;
-        _size <<= 1;
+    if(base == MAP_FAILED)
+    {
+        return NULL;
     }
 
-    return hshg;
+    const size_t head = -(uintptr_t) base & (HSHG_HUGEPAGE_SIZE - 1);
 
-    err_hshg:
-    free(hshg);
+    if(head != 0)
+    {
+        (void) munmap(base, head);
+    }
 
-    err:
-    return NULL;
+    (void) munmap(base + head + len, HSHG_HUGEPAGE_SIZE - head);
+    (void) madvise(base + head, len, MADV_HUGEPAGE);
+
+    return base + head;
 }
 
 
-void
-_hshg_free(_hshg* const hshg)
+static void*
+hshg_hugepage_malloc(void* const ctx, const size_t size, const size_t align)
 {
-    free(hshg->entities);
-    free(hshg->cells);
-    free(hshg);
-}
+    (void) ctx;
 
+    const size_t header = max(align, (size_t) HSHG_CACHE_LINE);
+    const int mapped = header + size >= HSHG_HUGEPAGE_SIZE;
+    size_t len;
+    uint8_t* base;
 
-hshg_attrib_const
-size_t
-_hshg_memory_usage(const _hshg_cell_t side,
-    const _hshg_entity_t max_entities)
-{
-    const size_t entities = sizeof(_hshg_entity) * max_entities;
-    const size_t cells = sizeof(_hshg_entity_t) * hshg_max_cells(side);
-    const size_t grids = sizeof(_hshg_grid) * hshg_max_grids(side);
-    const size_t hshg = sizeof(_hshg);
-    return entities + cells + grids + hshg;
+    if(mapped)
+    {
+        len = hshg_hugepage_round(header + size);
+        base = hshg_hugepage_map(len);
+    }
+    else
+    {
+        len = (header + size + header - 1) & ~(header - 1);
+        base = aligned_alloc(header, len);
+    }
+
+    if(base == NULL)
+    {
+        return NULL;
+    }
+
+    size_t* const words = hshg_hugepage_header(base + header);
+
+    words[0] = len - header;
+    words[1] = header | mapped;
+
+    return base + header;
 }
 
 
-int
-_hshg_set_size(_hshg* const hshg, const _hshg_entity_t size)
+static void*
+hshg_hugepage_calloc(void* const ctx, const size_t size, const size_t align)
 {
-    assert(!hshg->calling &&
-        "hshg_set_size() may not be called from any callback");
-    assert(size >= hshg->entities_used);
+    void* const ptr = hshg_hugepage_malloc(ctx, size, align);
 
-    void* const ptr = realloc(hshg->entities, sizeof(_hshg_entity) * size);
-
-    if(ptr == NULL)
+    /*
+     * Fresh mappings are already zeroed by the kernel.
+     */
+    if(ptr != NULL && !(hshg_hugepage_header(ptr)[1] & 1))
     {
-        return -1;
+        (void) memset(ptr, 0, size);
     }
 
-    hshg->entities = ptr;
-    hshg->entities_size = size;
-
-    return 0;
+    return ptr;
 }
 
 
 static void
-invalidate_entity(_hshg_entity* const entity)
+hshg_hugepage_free(void* const ctx, void* const ptr)
 {
-    entity->cell = _hshg_cell_sq_max;
-}
+    (void) ctx;
 
+    if(ptr == NULL)
+    {
+        return;
+    }
 
-static int
-invalid_entity(const _hshg_entity* const entity)
-{
-    return entity->cell == _hshg_cell_sq_max;
+    const size_t* const words = hshg_hugepage_header(ptr);
+    const size_t header = words[1] & ~(size_t) 1;
+    uint8_t* const base = (uint8_t*) ptr - header;
+
+    if(words[1] & 1)
+    {
+        (void) munmap(base, words[0] + header);
+    }
+    else
+    {
+        free(base);
+    }
 }
 
 
-static _hshg_entity_t
-hshg_get_entity(_hshg* const hshg)
+static void*
+hshg_hugepage_realloc(void* const ctx, void* const ptr,
+    const size_t size, const size_t align)
 {
-    if(hshg->free_entity != 0)
+    if(ptr == NULL)
     {
-        const _hshg_entity_t ret = hshg->free_entity;
-
-        hshg->free_entity = hshg->entities[ret].next;
-
-        return ret;
+        return hshg_hugepage_malloc(ctx, size, align);
     }
 
-    if(hshg->entities_used == hshg->entities_size)
+    size_t* const words = hshg_hugepage_header(ptr);
+    const size_t usable = words[0];
+
+    if(size <= usable)
     {
-        const _hshg_entity_t size = hshg->entities_size << 1;
-        const _hshg_entity_t entities_size =
-            hshg->entities_size > size ? _hshg_entity_max : size;
+        const size_t header = words[1] & ~(size_t) 1;
+        const size_t len = hshg_hugepage_round(header + size);
 
-        if(_hshg_set_size(hshg, entities_size) == -1)
+        if((words[1] & 1) && len < header + usable)
         {
-            return 0;
+            (void) munmap((uint8_t*) ptr - header + len,
+                header + usable - len);
+
+            words[0] = len - header;
         }
-    }
 
-    return hshg->entities_used++;
-}
+        return ptr;
+    }
 
+    void* const new_ptr = hshg_hugepage_malloc(ctx, size, align);
 
-static void
-hshg_return_entity(_hshg* const hshg)
-{
-    const _hshg_entity_t idx = hshg->entity_id;
-    _hshg_entity* const ent = hshg->entities + idx;
+    if(new_ptr == NULL)
+    {
+        return NULL;
+    }
 
-    invalidate_entity(ent);
+    (void) memcpy(new_ptr, ptr, usable);
+    hshg_hugepage_free(ctx, ptr);
 
-    ent->next = hshg->free_entity;
-    hshg->free_entity = idx;
+    return new_ptr;
 }
 
 
-hshg_attrib_const
-static _hshg_cell_t
-grid_get_cell_1d(const _hshg_grid* const grid, const _hshg_pos_t x)
+const _hshg_allocator _hshg_hugepage_allocator =
 {
-    const _hshg_cell_t cell = fabsf(x) * grid->inverse_cell_size;
+    .ctx = NULL,
+    .malloc = hshg_hugepage_malloc,
+    .calloc = hshg_hugepage_calloc,
+    .realloc = hshg_hugepage_realloc,
+    .free = hshg_hugepage_free
+};
 
-    if(cell & grid->cells_side)
-    {
-        return grid->cells_mask - (cell & grid->cells_mask);
-    }
-    else
-    {
-        return cell & grid->cells_mask;
-    }
-}
+#endif /* HSHG_HUGEPAGES */
 
 
-hshg_attrib_const
-static _hshg_cell_sq_t
-grid_get_idx(const _hshg_grid* const grid, const _hshg_cell_sq_t x
-    _2D(, const _hshg_cell_sq_t y) _3D(, const _hshg_cell_sq_t z))
+hshg_attrib_always_inline
+static inline void*
+hshg_mem_malloc(const _hshg_allocator* const allocator,
+    const size_t size, const size_t align)
 {
-    return x _2D( | (y << grid->cells2d_log)) _3D( | (z << grid->cells3d_log));
+    return allocator->malloc(allocator->ctx, size, align);
 }
 
 
-hshg_attrib_const
-static _hshg_cell_t
-idx_get_x(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+hshg_attrib_always_inline
+static inline void*
+hshg_mem_calloc(const _hshg_allocator* const allocator,
+    const size_t size, const size_t align)
 {
-    return cell & grid->cells_mask;
+    return allocator->calloc(allocator->ctx, size, align);
 }
 
 
-_2D(
-
-hshg_attrib_const
-static _hshg_cell_t
-idx_get_y(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+hshg_attrib_always_inline
+static inline void*
+hshg_mem_realloc(const _hshg_allocator* const allocator, void* const ptr,
+    const size_t size, const size_t align)
 {
-    return (cell >> grid->cells2d_log) _3D( & grid->cells_mask);
+    return allocator->realloc(allocator->ctx, ptr, size, align);
 }
 
-)
 
+hshg_attrib_always_inline
+static inline void
+hshg_mem_free(const _hshg_allocator* const allocator, void* const ptr)
+{
+    allocator->free(allocator->ctx, ptr);
+}
 
-_3D(
 
 hshg_attrib_const
 static _hshg_cell_t
-idx_get_z(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+hshg_halve_side(const _hshg_cell_t side)
 {
-    return cell >> grid->cells3d_log;
+    return side > 1 ? side >> 1 : 1;
 }
 
-)
-
 
+/*
+ * Number of cells taken up by a grid with the given sides, including its
+ * border with HSHG_GHOST.
+ */
 hshg_attrib_const
 static _hshg_cell_sq_t
-grid_get_cell(const _hshg_grid* const grid, const _hshg_pos_t x
-    _2D(, const _hshg_pos_t y) _3D(, const _hshg_pos_t z))
+hshg_grid_cells(const _hshg_cell_t side_x
+    _2D(, const _hshg_cell_t side_y) _3D(, const _hshg_cell_t side_z))
 {
-    const _hshg_cell_t cell_x = grid_get_cell_1d(grid, x);
-_2D(const _hshg_cell_t cell_y = grid_get_cell_1d(grid, y);)
-_3D(const _hshg_cell_t cell_z = grid_get_cell_1d(grid, z);)
-
-    return grid_get_idx(grid, cell_x _2D(, cell_y) _3D(, cell_z));
+    return (_hshg_cell_sq_t)(side_x _HSHG_GHOST(+ 2))
+    _2D(* (side_y _HSHG_GHOST(+ 2))) _3D(* (side_z _HSHG_GHOST(+ 2)));
 }
 
 
 hshg_attrib_const
 static uint8_t
-hshg_get_grid(const _hshg* const hshg, const _hshg_pos_t r)
+hshg_max_grids(const _hshg_cell_t side_x
+    _2D(, const _hshg_cell_t side_y) _3D(, const _hshg_cell_t side_z))
 {
-    const uint32_t rounded = r + r;
+    _hshg_cell_t side = side_x;
+_2D(side = max(side, side_y);)
+_3D(side = max(side, side_z);)
+
+    uint8_t grids_len = 0;
 
-    if(rounded < hshg->cell_size)
+    do
     {
-        return 0;
+        ++grids_len;
+        side >>= 1;
     }
+    while(side >= 2);
 
-    const uint8_t grid = hshg->cell_log - __builtin_clz(rounded) + 1;
-
-    return min(grid, hshg->grids_len - 1);
+    return grids_len;
 }
 
 
-static void
-hshg_reinsert(_hshg* const hshg, const _hshg_entity_t idx)
+hshg_attrib_const
+static _hshg_cell_sq_t
+hshg_max_cells(_hshg_cell_t side_x
+    _2D(, _hshg_cell_t side_y) _3D(, _hshg_cell_t side_z))
 {
-    _hshg_entity* const entity = hshg->entities + idx;
-    _hshg_grid* const grid = hshg->grids + entity->grid;
-
-    entity->cell = grid_get_cell(grid,
-        entity->x _2D(, entity->y) _3D(, entity->z));
-
-    _hshg_entity_t* const cell = grid->cells + entity->cell;
+    const uint8_t grids_len =
+        hshg_max_grids(side_x _2D(, side_y) _3D(, side_z));
 
-    entity->next = *cell;
+    _hshg_cell_sq_t cells_len = 0;
 
-    if(entity->next != 0)
+    for(uint8_t i = 0; i < grids_len; ++i)
     {
-        hshg->entities[entity->next].prev = idx;
-    }
+        const _hshg_cell_sq_t new = cells_len +
+            hshg_grid_cells(side_x _2D(, side_y) _3D(, side_z));
 
-    entity->prev = 0;
-    *cell = idx;
+        assert(new > cells_len &&
+            "_hshg_cell_sq_t must be set to a wider data type");
+        assert(new - cells_len <= _hshg_cell_invalid &&
+            "_hshg_cell_sq_t must be set to a wider data type");
 
-    if(grid->entities_len == 0)
-    {
-        hshg->new_cache |= UINT32_C(1) << entity->grid;
+        cells_len = new;
+        side_x = hshg_halve_side(side_x);
+    _2D(side_y = hshg_halve_side(side_y);)
+    _3D(side_z = hshg_halve_side(side_z);)
     }
 
-    ++grid->entities_len;
+    return cells_len;
+}
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+hshg_cells_used_len(const _hshg_cell_sq_t cells_len)
+{
+    return (cells_len + 63) >> 6;
+}
+
+
+static void
+hshg_cell_set_used(_hshg* const hshg, const _hshg_cell_sq_t cell)
+{
+    hshg->cells_used[cell >> 6] |= UINT64_C(1) << (cell & 63);
+}
+
+
+static void
+hshg_cell_set_unused(_hshg* const hshg, const _hshg_cell_sq_t cell)
+{
+    hshg->cells_used[cell >> 6] &= ~(UINT64_C(1) << (cell & 63));
+}
+
+
+#ifdef HSHG_SPARSE
+
+/*
+ * Smallest capacity of the table of cells that keeps it at most half full.
+ * Every cell in it has at least one entity, so it's never fuller than that.
+ */
+hshg_attrib_const
+static _hshg_cell_sq_t
+hshg_cells_table_len(const _hshg_entity_t entities)
+{
+    _hshg_cell_sq_t len = 2;
+
+    while(len < (uint64_t) entities << 1)
+    {
+        len <<= 1;
+    }
+
+    return len;
+}
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+hshg_cells_hash(const _hshg_cell_sq_t key, const _hshg_cell_sq_t len)
+{
+    return (key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - __builtin_ctzll(len));
+}
+
+
+/*
+ * Returns the slot the given cell is in, or the empty slot it would be
+ * inserted into.
+ */
+static _hshg_cell_sq_t
+hshg_cells_find(const _hshg_entity_t* const cells,
+    const _hshg_cell_sq_t* const keys, const _hshg_cell_sq_t len,
+    const _hshg_cell_sq_t key)
+{
+    const _hshg_cell_sq_t mask = len - 1;
+    _hshg_cell_sq_t slot = hshg_cells_hash(key, len);
+
+    while(cells[slot] != 0 && keys[slot] != key)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+
+static _hshg_entity_t
+hshg_cell_get(const _hshg* const hshg, const _hshg_grid* const grid,
+    const _hshg_cell_sq_t cell)
+{
+    return hshg->cells[hshg_cells_find(hshg->cells,
+        hshg->keys, hshg->cells_len, grid->cells + cell)];
+}
+
+
+/*
+ * Returns the head of the given cell. If the cell is empty, the caller must
+ * store a non-zero entity in it.
+ */
+static _hshg_entity_t*
+hshg_cell_ptr(_hshg* const hshg, const _hshg_grid* const grid,
+    const _hshg_cell_sq_t cell)
+{
+    const _hshg_cell_sq_t key = grid->cells + cell;
+    const _hshg_cell_sq_t slot =
+        hshg_cells_find(hshg->cells, hshg->keys, hshg->cells_len, key);
+
+    hshg->keys[slot] = key;
+
+    return hshg->cells + slot;
+}
+
+
+/*
+ * Removes the given cell from the table. Following cells that could have been
+ * placed in the freed slot are shifted back into it, so that lookups never
+ * need to skip over deleted slots.
+ */
+static void
+hshg_cell_clear(_hshg* const hshg, const _hshg_grid* const grid,
+    const _hshg_cell_sq_t cell)
+{
+    const _hshg_cell_sq_t mask = hshg->cells_len - 1;
+    _hshg_cell_sq_t hole = hshg_cells_find(hshg->cells,
+        hshg->keys, hshg->cells_len, grid->cells + cell);
+    _hshg_cell_sq_t slot = hole;
+
+    while(1)
+    {
+        slot = (slot + 1) & mask;
+
+        if(hshg->cells[slot] == 0)
+        {
+            break;
+        }
+
+        const _hshg_cell_sq_t home =
+            hshg_cells_hash(hshg->keys[slot], hshg->cells_len);
+
+        if(((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            hshg->cells[hole] = hshg->cells[slot];
+            hshg->keys[hole] = hshg->keys[slot];
+
+            hole = slot;
+        }
+    }
+
+    hshg->cells[hole] = 0;
+    hshg_cell_set_unused(hshg, hole);
+}
+
+
+static int
+hshg_cells_resize(_hshg* const hshg, const _hshg_cell_sq_t len)
+{
+    const _hshg_allocator* const allocator = &hshg->allocator;
+    _hshg_entity_t* const cells = hshg_mem_calloc(allocator,
+        sizeof(_hshg_entity_t) * len, HSHG_CACHE_LINE);
+    _hshg_cell_sq_t* const keys = hshg_mem_malloc(allocator,
+        sizeof(_hshg_cell_sq_t) * len, hshg_align);
+    uint64_t* const cells_used = hshg_mem_calloc(allocator,
+        sizeof(uint64_t) * hshg_cells_used_len(len), hshg_align);
+
+    if(cells == NULL || keys == NULL || cells_used == NULL)
+    {
+        hshg_mem_free(allocator, cells);
+        hshg_mem_free(allocator, keys);
+        hshg_mem_free(allocator, cells_used);
+
+        return -1;
+    }
+
+    _hshg_entity_t* const old_cells = hshg->cells;
+    _hshg_cell_sq_t* const old_keys = hshg->keys;
+    uint64_t* const old_cells_used = hshg->cells_used;
+    const _hshg_cell_sq_t old_len = hshg->cells_len;
+
+    (void) memcpy((void*) &hshg->cells, &cells, sizeof(cells));
+    (void) memcpy((void*) &hshg->keys, &keys, sizeof(keys));
+    (void) memcpy((void*) &hshg->cells_used, &cells_used, sizeof(cells_used));
+    (void) memcpy((void*) &hshg->cells_len, &len, sizeof(len));
+
+    for(_hshg_cell_sq_t i = 0; i < old_len; ++i)
+    {
+        if(old_cells[i] == 0)
+        {
+            continue;
+        }
+
+        const _hshg_cell_sq_t slot =
+            hshg_cells_find(cells, keys, len, old_keys[i]);
+
+        cells[slot] = old_cells[i];
+        keys[slot] = old_keys[i];
+        hshg_cell_set_used(hshg, slot);
+    }
+
+    hshg_mem_free(allocator, old_cells);
+    hshg_mem_free(allocator, old_keys);
+    hshg_mem_free(allocator, old_cells_used);
+
+    return 0;
+}
+
+#else
+
+static _hshg_entity_t
+hshg_cell_get(const _hshg* const hshg, const _hshg_grid* const grid,
+    const _hshg_cell_sq_t cell)
+{
+    (void) hshg;
+
+    return grid->cells[cell];
+}
+
+
+static _hshg_entity_t*
+hshg_cell_ptr(_hshg* const hshg, const _hshg_grid* const grid,
+    const _hshg_cell_sq_t cell)
+{
+    (void) hshg;
+
+    return grid->cells + cell;
+}
+
+
+static void
+hshg_cell_clear(_hshg* const hshg, const _hshg_grid* const grid,
+    const _hshg_cell_sq_t cell)
+{
+    grid->cells[cell] = 0;
+    hshg_cell_set_unused(hshg, grid->cells + cell - hshg->cells);
+}
+
+#endif /* HSHG_SPARSE */
+
+
+#ifdef HSHG_STATIC_SIDE
+
+#define HSHG_STATIC_GRIDS_LEN \
+    (HSHG_STATIC_SIDE > 1 ? __builtin_ctz(HSHG_STATIC_SIDE) : 1)
+
+#define hshg_static_side(level) \
+    (HSHG_STATIC_SIDE >> (level) ? HSHG_STATIC_SIDE >> (level) : 1)
+
+#define hshg_static_grid(level)                                         \
+{                                                                       \
+    .cells_side =                                                       \
+    {                                                                   \
+            hshg_static_side(level)                                     \
+        _2D(, hshg_static_side(level))                                  \
+        _3D(, hshg_static_side(level))                                  \
+    },                                                                  \
+_3D(.cells_sq = (_hshg_cell_sq_t) hshg_static_side(level) *             \
+        hshg_static_side(level),)                                       \
+    .cells_mask =                                                       \
+    {                                                                   \
+            hshg_static_side(level) - 1                                 \
+        _2D(, hshg_static_side(level) - 1)                              \
+        _3D(, hshg_static_side(level) - 1)                              \
+    },                                                                  \
+_2D(.cells2d_log = __builtin_ctz(hshg_static_side(level)),)             \
+_3D(.cells3d_log = __builtin_ctz(hshg_static_side(level)) * 2,)         \
+_HSHG_INTEGER(.cell_log = __builtin_ctz(HSHG_STATIC_CELL_SIZE) + (level),) \
+_HSHG_FLOAT(.inverse_cell_size = (_hshg_pos_t) 1.0 /                    \
+        ((uint64_t) HSHG_STATIC_CELL_SIZE << (level)),)                 \
+}
+
+/*
+ * Geometry of every grid as hshg_create() would set it up, for code that is
+ * unrolled over grids to read from instead of the real grids. Only the first
+ * HSHG_STATIC_GRIDS_LEN entries are ever used.
+ */
+static const _hshg_grid hshg_static_grids[32] =
+{
+    hshg_static_grid(0),  hshg_static_grid(1),  hshg_static_grid(2),
+    hshg_static_grid(3),  hshg_static_grid(4),  hshg_static_grid(5),
+    hshg_static_grid(6),  hshg_static_grid(7),  hshg_static_grid(8),
+    hshg_static_grid(9),  hshg_static_grid(10), hshg_static_grid(11),
+    hshg_static_grid(12), hshg_static_grid(13), hshg_static_grid(14),
+    hshg_static_grid(15), hshg_static_grid(16), hshg_static_grid(17),
+    hshg_static_grid(18), hshg_static_grid(19), hshg_static_grid(20),
+    hshg_static_grid(21), hshg_static_grid(22), hshg_static_grid(23),
+    hshg_static_grid(24), hshg_static_grid(25), hshg_static_grid(26),
+    hshg_static_grid(27), hshg_static_grid(28), hshg_static_grid(29),
+    hshg_static_grid(30), hshg_static_grid(31)
+};
+
+#undef hshg_static_grid
+#undef hshg_static_side
+
+#endif /* HSHG_STATIC_SIDE */
+
+
+#ifdef HSHG_GHOST
+
+/*
+ * Fills the stencil with offsets of the cell and all of its neighbours. Rows
+ * are at least 3 cells long, so the offsets come out in increasing order.
+ */
+static void
+grid_init_stencil(_hshg_grid* const grid)
+{
+    _hshg_cell_sq_t* const stencil = (_hshg_cell_sq_t*) grid->stencil;
+
+    uint8_t i = 0;
+
+_3D(for(int z = -1; z <= 1; ++z))
+    {
+
+_2D(for(int y = -1; y <= 1; ++y))
+    {
+
+    for(int x = -1; x <= 1; ++x)
+    {
+        stencil[i++] = (_hshg_cell_sq_t)(x
+            _2D(+ y * (int64_t) grid->stride_y)
+            _3D(+ z * (int64_t) grid->stride_z));
+    }
+
+    }
+
+    }
+}
+
+#endif /* HSHG_GHOST */
+
+
+_hshg*
+_hshg_create(const _hshg_cell_t side, const uint32_t size)
+{
+    return _hshg_create_rect_alloc(side _2D(, side) _3D(, side), size, NULL);
+}
+
+
+_hshg*
+_hshg_create_rect(const _hshg_cell_t side_x _2D(, const _hshg_cell_t side_y)
+    _3D(, const _hshg_cell_t side_z), const uint32_t size)
+{
+    return _hshg_create_rect_alloc(side_x _2D(, side_y) _3D(, side_z),
+        size, NULL);
+}
+
+
+_hshg*
+_hshg_create_alloc(const _hshg_cell_t side, const uint32_t size,
+    const _hshg_allocator* const allocator)
+{
+    return _hshg_create_rect_alloc(side _2D(, side) _3D(, side),
+        size, allocator);
+}
+
+
+_hshg*
+_hshg_create_rect_alloc(const _hshg_cell_t side_x
+    _2D(, const _hshg_cell_t side_y) _3D(, const _hshg_cell_t side_z),
+    const uint32_t size, const _hshg_allocator* allocator)
+{
+    if(allocator == NULL)
+    {
+        allocator = &_hshg_libc_allocator;
+    }
+
+    assert(__builtin_popcount(side_x) == 1 &&
+        "All arguments must be powers of 2");
+_2D(assert(__builtin_popcount(side_y) == 1 &&
+        "All arguments must be powers of 2");)
+_3D(assert(__builtin_popcount(side_z) == 1 &&
+        "All arguments must be powers of 2");)
+    assert(__builtin_popcount(size) == 1 &&
+        "All arguments must be powers of 2");
+
+#ifdef HSHG_MORTON
+_2D(assert(side_x == side_y && "HSHG_MORTON requires all sides to be equal");)
+_3D(assert(side_x == side_z && "HSHG_MORTON requires all sides to be equal");)
+#endif
+
+#ifdef HSHG_STATIC_SIDE
+    assert(side_x == HSHG_STATIC_SIDE _2D(&& side_y == HSHG_STATIC_SIDE)
+        _3D(&& side_z == HSHG_STATIC_SIDE) &&
+        "All sides must be equal to HSHG_STATIC_SIDE");
+    assert(size == HSHG_STATIC_CELL_SIZE &&
+        "The cell size must be equal to HSHG_STATIC_CELL_SIZE");
+#endif
+
+_HSHG_DENSE(
+    const _hshg_cell_sq_t cells_len =
+        hshg_max_cells(side_x _2D(, side_y) _3D(, side_z));
+)
+_HSHG_SPARSE(
+    (void) hshg_max_cells(side_x _2D(, side_y) _3D(, side_z));
+
+    const _hshg_cell_sq_t cells_len = hshg_cells_table_len(1);
+)
+    const uint8_t grids_len =
+        hshg_max_grids(side_x _2D(, side_y) _3D(, side_z));
+
+    _hshg* const hshg = hshg_mem_malloc(allocator,
+        sizeof(_hshg) + sizeof(_hshg_grid) * grids_len, hshg_align);
+
+    if(hshg == NULL)
+    {
+        goto err;
+    }
+
+    _hshg_entity_t* const cells = hshg_mem_calloc(allocator,
+        sizeof(_hshg_entity_t) * cells_len, HSHG_CACHE_LINE);
+
+    if(cells == NULL)
+    {
+        goto err_hshg;
+    }
+
+    uint64_t* const cells_used = hshg_mem_calloc(allocator,
+        sizeof(uint64_t) * hshg_cells_used_len(cells_len), hshg_align);
+
+    if(cells_used == NULL)
+    {
+        goto err_cells;
+    }
+
+_HSHG_SPARSE(
+    _hshg_cell_sq_t* const keys = hshg_mem_malloc(allocator,
+        sizeof(_hshg_cell_sq_t) * cells_len, hshg_align);
+
+    if(keys == NULL)
+    {
+        goto err_cells_used;
+    }
+)
+
+    const _hshg_cell_sq_t grid_size_x = (_hshg_cell_sq_t) side_x * size;
+_2D(const _hshg_cell_sq_t grid_size_y = (_hshg_cell_sq_t) side_y * size;)
+_3D(const _hshg_cell_sq_t grid_size_z = (_hshg_cell_sq_t) side_z * size;)
+
+    (void) memcpy(hshg, &(
+    (_hshg)
+    {
+        .entities = NULL,
+        .cells = cells,
+    _HSHG_SPARSE(.keys = keys,)
+        .cells_used = cells_used,
+
+        .update = NULL,
+        .collide = NULL,
+        .query = NULL,
+        .barrier = NULL,
+
+        .allocator = *allocator,
+
+        .cell_log = 31 - __builtin_ctz(size),
+        .grids_len = grids_len,
+
+        .calling = 0,
+        .removed = 0,
+    _HSHG_CSR(.csr = 0,)
+
+        .old_cache = 0,
+        .new_cache = 0,
+
+        .grid_size =
+        {
+            grid_size_x _2D(, grid_size_y) _3D(, grid_size_z)
+        },
+    _HSHG_FLOAT(
+        .inverse_grid_size =
+        {
+                (_hshg_pos_t) 1.0 / grid_size_x
+            _2D(, (_hshg_pos_t) 1.0 / grid_size_y)
+            _3D(, (_hshg_pos_t) 1.0 / grid_size_z)
+        },
+    )
+    _HSHG_INTEGER(
+        .grid_log =
+        {
+                __builtin_ctzll(grid_size_x)
+            _2D(, __builtin_ctzll(grid_size_y))
+            _3D(, __builtin_ctzll(grid_size_z))
+        },
+    )
+        .cells_len = cells_len,
+        .cell_size = size,
+
+        .free_entity = 0,
+        .entities_used = 1,
+        .entities_size = 1,
+        .entity_id = 0,
+
+        .optimize_cell = 0,
+        .optimize_idx = 1,
+
+        .optimize_entities = NULL,
+        .optimize_counts = NULL,
+
+    _HSHG_CSR(.csr_ends = NULL,)
+    _HSHG_SLEEP(.awake = NULL,)
+
+        .update_commands = NULL,
+        .update_counts = NULL,
+        .update_removed = NULL,
+        .update_threads = 0
+    }
+    ), sizeof(_hshg));
+
+    _hshg_cell_sq_t idx = 0;
+    uint32_t _size = size;
+
+    _hshg_cell_t _side_x = side_x;
+_2D(_hshg_cell_t _side_y = side_y;)
+_3D(_hshg_cell_t _side_z = side_z;)
+
+    for(uint8_t i = 0; i < grids_len; ++i)
+    {
+        (void) memcpy(hshg->grids + i, &(
+        (_hshg_grid)
+        {
+        _HSHG_DENSE(.cells = hshg->cells + idx,)
+        _HSHG_SPARSE(.cells = idx,)
+
+            .cells_side = { _side_x _2D(, _side_y) _3D(, _side_z) },
+        _3D(.cells_sq = (_hshg_cell_sq_t) _side_x * _side_y,)
+            .cells_mask =
+            {
+                _side_x - 1 _2D(, _side_y - 1) _3D(, _side_z - 1)
+            },
+
+        _2D(.cells2d_log = __builtin_ctz(_side_x),)
+        _3D(.cells3d_log = __builtin_ctz(_side_x) + __builtin_ctz(_side_y),)
+        _HSHG_GHOST(
+        _2D(.stride_y = (_hshg_cell_sq_t) _side_x + 2,)
+        _3D(.stride_z = ((_hshg_cell_sq_t) _side_x + 2) * (_side_y + 2),)
+        )
+        _HSHG_HASHED(.cells_log = i == grids_len - 1 ? 0 :
+            __builtin_ctz(_side_x) _2D(+ __builtin_ctz(_side_y))
+            _3D(+ __builtin_ctz(_side_z)),)
+
+            .shift = 0,
+        _HSHG_INTEGER(.cell_log = __builtin_ctz(_size),)
+
+        _HSHG_FLOAT(.inverse_cell_size = (_hshg_pos_t) 1.0 / _size,)
+
+        _HSHG_LOOSE(.loose_margin = _HSHG_INTEGER((_hshg_pos_t)(_size >> 2))
+            _HSHG_FLOAT((_hshg_pos_t) _size / 4),)
+
+            .entities_len = 0
+        }
+        ), sizeof(_hshg_grid));
+
+    _HSHG_GHOST(grid_init_stencil(hshg->grids + i);)
+
+        idx += hshg_grid_cells(_side_x _2D(, _side_y) _3D(, _side_z));
+        _side_x = hshg_halve_side(_side_x);
+    _2D(_side_y = hshg_halve_side(_side_y);)
+    _3D(_side_z = hshg_halve_side(_side_z);)
+        _size <<= 1;
+    }
+
+    return hshg;
+
+_HSHG_SPARSE(
+    err_cells_used:
+    hshg_mem_free(allocator, cells_used);
+)
+
+    err_cells:
+    hshg_mem_free(allocator, cells);
+
+    err_hshg:
+    hshg_mem_free(allocator, hshg);
+
+    err:
+    return NULL;
+}
+
+
+void
+_hshg_free(_hshg* const hshg)
+{
+    const _hshg_allocator allocator = hshg->allocator;
+
+    hshg_mem_free(&allocator, hshg->entities);
+    hshg_mem_free(&allocator, hshg->cells);
+_HSHG_SPARSE(hshg_mem_free(&allocator, hshg->keys);)
+    hshg_mem_free(&allocator, hshg->cells_used);
+_HSHG_CSR(hshg_mem_free(&allocator, hshg->csr_ends);)
+_HSHG_SLEEP(hshg_mem_free(&allocator, hshg->awake);)
+    hshg_mem_free(&allocator, hshg->update_commands);
+    hshg_mem_free(&allocator, hshg->update_counts);
+    hshg_mem_free(&allocator, hshg->update_removed);
+    hshg_mem_free(&allocator, hshg);
+}
+
+
+hshg_attrib_const
+size_t
+_hshg_memory_usage(const _hshg_cell_t side,
+    const _hshg_entity_t max_entities)
+{
+    return _hshg_memory_usage_rect(side _2D(, side) _3D(, side), max_entities);
+}
+
+
+hshg_attrib_const
+size_t
+_hshg_memory_usage_rect(const _hshg_cell_t side_x
+    _2D(, const _hshg_cell_t side_y) _3D(, const _hshg_cell_t side_z),
+    const _hshg_entity_t max_entities)
+{
+    const size_t entities = sizeof(_hshg_entity) * max_entities;
+_HSHG_DENSE(
+    const _hshg_cell_sq_t cells_len =
+        hshg_max_cells(side_x _2D(, side_y) _3D(, side_z));
+    const size_t cells = sizeof(_hshg_entity_t) * cells_len;
+)
+_HSHG_SPARSE(
+    const _hshg_cell_sq_t cells_len = hshg_cells_table_len(max_entities);
+    const size_t cells =
+        (sizeof(_hshg_entity_t) + sizeof(_hshg_cell_sq_t)) * cells_len;
+)
+    const size_t cells_used =
+        sizeof(uint64_t) * hshg_cells_used_len(cells_len);
+    const size_t grids = sizeof(_hshg_grid) *
+        hshg_max_grids(side_x _2D(, side_y) _3D(, side_z));
+    const size_t hshg = sizeof(_hshg);
+_HSHG_CSR(const size_t csr_ends = sizeof(_hshg_entity_t) * max_entities;)
+_HSHG_SLEEP(
+    const size_t awake = sizeof(uint64_t) * hshg_cells_used_len(max_entities);
+)
+    const size_t update_commands = sizeof(_hshg_entity_t) * max_entities;
+    const size_t update_removed =
+        sizeof(uint64_t) * hshg_cells_used_len(max_entities);
+
+    return entities + cells + cells_used + grids + hshg
+        _HSHG_CSR(+ csr_ends) _HSHG_SLEEP(+ awake)
+        + update_commands + update_removed;
+}
+
+
+int
+_hshg_set_size(_hshg* const hshg, const _hshg_entity_t size)
+{
+    assert(!hshg->calling &&
+        "hshg_set_size() may not be called from any callback");
+    assert(size >= hshg->entities_used);
+
+_HSHG_SPARSE(
+    const _hshg_cell_sq_t cells_len = hshg_cells_table_len(size);
+
+    if(cells_len > hshg->cells_len && hshg_cells_resize(hshg, cells_len) == -1)
+    {
+        return -1;
+    }
+)
+
+    void* const ptr = hshg_mem_realloc(&hshg->allocator, hshg->entities,
+        sizeof(_hshg_entity) * size, HSHG_CACHE_LINE);
+
+    if(ptr == NULL)
+    {
+        return -1;
+    }
+
+    hshg->entities = ptr;
+
+    /*
+     * Side arrays are resized only once entities were, so that a failure
+     * leaves every array at least as big as entities_size. One that can't be
+     * shrunk is still big enough, so it's kept.
+     */
+_HSHG_CSR(
+    _hshg_entity_t* const csr_ends = hshg_mem_realloc(&hshg->allocator,
+        hshg->csr_ends, sizeof(_hshg_entity_t) * size, hshg_align);
+
+    if(csr_ends != NULL)
+    {
+        hshg->csr_ends = csr_ends;
+    }
+    else if(size > hshg->entities_size || hshg->csr_ends == NULL)
+    {
+        return -1;
+    }
+)
+
+_HSHG_SLEEP(
+    const _hshg_entity_t awake_len = hshg_cells_used_len(size);
+    uint64_t* const awake = hshg_mem_realloc(&hshg->allocator,
+        hshg->awake, sizeof(uint64_t) * awake_len, hshg_align);
+
+    if(awake != NULL)
+    {
+        /*
+         * Bits past the used entities are always clear, so only the words
+         * that weren't there before need to be cleared.
+         */
+        const _hshg_entity_t awake_used = hshg->awake == NULL ? 0 :
+            hshg_cells_used_len(hshg->entities_used);
+
+        if(awake_len > awake_used)
+        {
+            (void) memset(awake + awake_used, 0,
+                sizeof(uint64_t) * (awake_len - awake_used));
+        }
+
+        hshg->awake = awake;
+    }
+    else if(size > hshg->entities_size || hshg->awake == NULL)
+    {
+        return -1;
+    }
+)
+
+    _hshg_entity_t* const update_commands = hshg_mem_realloc(&hshg->allocator,
+        hshg->update_commands, sizeof(_hshg_entity_t) * size, hshg_align);
+
+    if(update_commands != NULL)
+    {
+        hshg->update_commands = update_commands;
+    }
+    else if(size > hshg->entities_size || hshg->update_commands == NULL)
+    {
+        return -1;
+    }
+
+    uint64_t* const update_removed = hshg_mem_realloc(&hshg->allocator,
+        hshg->update_removed, sizeof(uint64_t) * hshg_cells_used_len(size),
+        hshg_align);
+
+    if(update_removed != NULL)
+    {
+        hshg->update_removed = update_removed;
+    }
+    else if(size > hshg->entities_size || hshg->update_removed == NULL)
+    {
+        return -1;
+    }
+
+    hshg->entities_size = size;
+
+_HSHG_SPARSE(
+    if(cells_len < hshg->cells_len)
+    {
+        /* On failure, the old table is still big enough to be used */
+        (void) hshg_cells_resize(hshg, cells_len);
+    }
+)
+
+    return 0;
+}
+
+
+static void
+invalidate_entity(_hshg_entity* const entity)
+{
+    entity->cell = _hshg_cell_invalid;
+}
+
+
+static int
+invalid_entity(const _hshg_entity* const entity)
+{
+    return entity->cell == _hshg_cell_invalid;
+}
+
+
+#ifdef HSHG_SLEEP
+
+/*
+ * Sets the entity's bit in the bitmap of awake entities to whether it's a
+ * valid entity that isn't asleep.
+ */
+static void
+hshg_awake_set(const _hshg* const hshg, const _hshg_entity_t idx)
+{
+    const _hshg_entity* const entity = hshg->entities + idx;
+    const uint64_t bit = UINT64_C(1) << (idx & 63);
+
+    if(invalid_entity(entity) || entity->asleep)
+    {
+        hshg->awake[idx >> 6] &= ~bit;
+    }
+    else
+    {
+        hshg->awake[idx >> 6] |= bit;
+    }
+}
+
+
+/*
+ * Sets bits of all entities after they were moved around in the array. Their
+ * flags move along with them.
+ */
+static void
+hshg_awake_build(_hshg* const hshg)
+{
+    const _hshg_entity_t awake_len = hshg_cells_used_len(hshg->entities_size);
+
+    (void) memset(hshg->awake, 0, sizeof(uint64_t) * awake_len);
+
+    for(_hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        hshg_awake_set(hshg, i);
+    }
+}
+
+
+/*
+ * The first awake entity from idx on, or end if there's none before it. The
+ * word is read again on every call, since callbacks may change it.
+ */
+static _hshg_entity_t
+hshg_awake_next(const _hshg* const hshg, _hshg_entity_t idx,
+    const _hshg_entity_t end)
+{
+    while(idx < end)
+    {
+        const uint64_t bits =
+            hshg->awake[idx >> 6] & (~UINT64_C(0) << (idx & 63));
+
+        if(bits != 0)
+        {
+            return min((idx & ~(_hshg_entity_t) 63) | __builtin_ctzll(bits),
+                end);
+        }
+
+        idx = (idx | 63) + 1;
+    }
+
+    return end;
+}
+
+#endif /* HSHG_SLEEP */
+
+
+static _hshg_entity_t
+hshg_get_entity(_hshg* const hshg)
+{
+    if(hshg->free_entity != 0)
+    {
+        const _hshg_entity_t ret = hshg->free_entity;
+
+        hshg->free_entity = hshg->entities[ret].next;
+    _HSHG_PREV(hshg->entities[hshg->free_entity].prev = 0;)
+
+        return ret;
+    }
+
+    if(hshg->entities_used == hshg->entities_size)
+    {
+        const _hshg_entity_t size = hshg->entities_size << 1;
+        const _hshg_entity_t entities_size =
+            hshg->entities_size > size ? _hshg_entity_max : size;
+
+        if(_hshg_set_size(hshg, entities_size) == -1)
+        {
+            return 0;
+        }
+    }
+
+    return hshg->entities_used++;
+}
+
+
+static void
+hshg_return_entity(_hshg* const hshg)
+{
+    const _hshg_entity_t idx = hshg->entity_id;
+    _hshg_entity* const ent = hshg->entities + idx;
+
+    invalidate_entity(ent);
+_HSHG_SLEEP(hshg_awake_set(hshg, idx);)
+
+    ent->next = hshg->free_entity;
+_HSHG_PREV(
+    ent->prev = 0;
+    hshg->entities[hshg->free_entity].prev = idx;
+)
+    hshg->free_entity = idx;
+}
+
+
+#ifdef HSHG_SINGLY_LINKED
+
+/*
+ * Entities don't know their predecessors, so the list the entity is in has to
+ * be walked from its beginning.
+ */
+static _hshg_entity_t
+hshg_get_prev(const _hshg* const hshg, const _hshg_entity_t idx)
+{
+    const _hshg_entity* const entity = hshg->entities + idx;
+    _hshg_entity_t i;
+
+    if(invalid_entity(entity))
+    {
+        i = hshg->free_entity;
+    }
+    else
+    {
+        i = hshg_cell_get(hshg, hshg->grids + entity->grid, entity->cell);
+    }
+
+    if(i == idx)
+    {
+        return 0;
+    }
+
+    while(hshg->entities[i].next != idx)
+    {
+        i = hshg->entities[i].next;
+    }
+
+    return i;
+}
+
+#else
+
+static _hshg_entity_t
+hshg_get_prev(const _hshg* const hshg, const _hshg_entity_t idx)
+{
+    return hshg->entities[idx].prev;
+}
+
+#endif /* HSHG_SINGLY_LINKED */
+
+
+hshg_attrib_const
+static _hshg_entity_t
+hshg_swap_idx(const _hshg_entity_t idx,
+    const _hshg_entity_t a, const _hshg_entity_t b)
+{
+    return idx == a ? b : idx == b ? a : idx;
+}
+
+
+static void
+hshg_swap_relink(_hshg* const hshg,
+    const _hshg_entity_t idx, const _hshg_entity_t prev)
+{
+    const _hshg_entity* const entity = hshg->entities + idx;
+
+    if(prev == 0)
+    {
+        if(invalid_entity(entity))
+        {
+            hshg->free_entity = idx;
+        }
+        else
+        {
+            const _hshg_grid* const grid = hshg->grids + entity->grid;
+
+            *hshg_cell_ptr(hshg, grid, entity->cell) = idx;
+        }
+    }
+    else
+    {
+        hshg->entities[prev].next = idx;
+    }
+
+_HSHG_PREV(hshg->entities[entity->next].prev = idx;)
+}
+
+
+/*
+ * Swaps two entities, or an entity and a hole, keeping all lists intact. The
+ * free list is linked just like cells are for this to be possible.
+ */
+static void
+hshg_swap_entities(_hshg* const hshg,
+    const _hshg_entity_t a, const _hshg_entity_t b)
+{
+    if(a == b)
+    {
+        return;
+    }
+
+    _hshg_entity* const entity_a = hshg->entities + a;
+    _hshg_entity* const entity_b = hshg->entities + b;
+
+    const _hshg_entity_t prev_a = hshg_swap_idx(hshg_get_prev(hshg, a), a, b);
+    const _hshg_entity_t prev_b = hshg_swap_idx(hshg_get_prev(hshg, b), a, b);
+
+    const _hshg_entity temp = *entity_a;
+
+    *entity_a = *entity_b;
+    *entity_b = temp;
+
+    /*
+     * The two might have been linked to each other, so all of their own links
+     * need to be fixed up before touching any of their neighbors.
+     */
+    entity_a->next = hshg_swap_idx(entity_a->next, a, b);
+_HSHG_PREV(entity_a->prev = prev_b;)
+    entity_b->next = hshg_swap_idx(entity_b->next, a, b);
+_HSHG_PREV(entity_b->prev = prev_a;)
+
+    hshg_swap_relink(hshg, a, prev_b);
+    hshg_swap_relink(hshg, b, prev_a);
+
+_HSHG_SLEEP(
+    hshg_awake_set(hshg, a);
+    hshg_awake_set(hshg, b);
+)
+}
+
+
+/*
+ * Moves an entity into a hole, fixing up its neighbours. Unlike with
+ * hshg_swap_entities(), the free list is left broken, so the caller must throw
+ * it away once there are no holes left below the moved entities.
+ */
+static void
+hshg_move_entity(_hshg* const hshg,
+    const _hshg_entity_t from, const _hshg_entity_t to)
+{
+    const _hshg_entity_t prev = hshg_get_prev(hshg, from);
+
+    hshg->entities[to] = hshg->entities[from];
+    invalidate_entity(hshg->entities + from);
+
+    hshg_swap_relink(hshg, to, prev);
+
+_HSHG_SLEEP(
+    hshg_awake_set(hshg, from);
+    hshg_awake_set(hshg, to);
+)
+}
+
+
+#ifdef HSHG_HASHED
+
+/*
+ * Coordinates of cells aren't bounded by the size of the grid, they can be
+ * anything a position can be divided into.
+ */
+typedef int64_t hshg_coord_t;
+
+#else
+
+typedef _hshg_cell_t hshg_coord_t;
+
+#endif /* HSHG_HASHED */
+
+
+#if defined(HSHG_HASHED)
+
+hshg_attrib_const
+static hshg_coord_t
+grid_get_cell_1d(const _hshg_grid* const grid,
+    const uint8_t axis, const _hshg_pos_t x)
+{
+    (void) axis;
+
+#ifdef HSHG_INTEGER
+    return x >> grid->cell_log;
+#else
+    const _hshg_pos_t cell = x * grid->inverse_cell_size;
+    const hshg_coord_t truncated = cell;
+
+    return truncated - (cell < truncated);
+#endif
+}
+
+#elif defined(HSHG_BOUNDED)
+
+hshg_attrib_const
+static _hshg_cell_t
+grid_get_cell_1d(const _hshg_grid* const grid,
+    const uint8_t axis, const _hshg_pos_t x)
+{
+#ifdef HSHG_INTEGER
+    if(x < 0)
+    {
+        return 0;
+    }
+
+    return min((uint64_t) x >> grid->cell_log,
+        (uint64_t) grid->cells_mask[axis]);
+#else
+    const _hshg_pos_t cell = x * grid->inverse_cell_size;
+
+    return min(max(cell, (_hshg_pos_t) 0),
+        (_hshg_pos_t) grid->cells_mask[axis]);
+#endif
+}
+
+#else
+
+#ifdef HSHG_INTEGER
+
+/*
+ * Wide enough for the absolute value of any position, and for any position
+ * shifted by the period of mirroring in hshg_map_pos().
+ */
+typedef uint64_t hshg_abs_pos_t;
+
+
+hshg_attrib_const
+static hshg_abs_pos_t
+hshg_abs(const _hshg_pos_t x)
+{
+    return x < 0 ? -(hshg_abs_pos_t) x : (hshg_abs_pos_t) x;
+}
+
+
+hshg_attrib_const
+static _hshg_cell_t
+grid_get_cell_abs(const _hshg_grid* const grid, const hshg_abs_pos_t x)
+{
+    return x >> grid->cell_log;
+}
+
+#else
+
+typedef _hshg_pos_t hshg_abs_pos_t;
+
+
+hshg_attrib_const
+static hshg_abs_pos_t
+hshg_abs(const _hshg_pos_t x)
+{
+    return _Generic(x,
+        float: fabsf,
+        double: fabs,
+        long double: fabsl
+    )(x);
+}
+
+
+/*
+ * Going through a 64-bit integer keeps the low bits of the cell, which are all
+ * that's needed for mirroring, even if the position is far out of the HSHG.
+ */
+hshg_attrib_const
+static _hshg_cell_t
+grid_get_cell_abs(const _hshg_grid* const grid, const hshg_abs_pos_t x)
+{
+    return (int64_t)(x * grid->inverse_cell_size);
+}
+
+#endif /* HSHG_INTEGER */
+
+
+hshg_attrib_const
+static _hshg_cell_t
+grid_get_cell_mirror(const _hshg_grid* const grid,
+    const uint8_t axis, const _hshg_cell_t cell)
+{
+    if(cell & grid->cells_side[axis])
+    {
+        return grid->cells_mask[axis] - (cell & grid->cells_mask[axis]);
+    }
+    else
+    {
+        return cell & grid->cells_mask[axis];
+    }
+}
+
+
+hshg_attrib_const
+static _hshg_cell_t
+grid_get_cell_1d(const _hshg_grid* const grid,
+    const uint8_t axis, const _hshg_pos_t x)
+{
+    return grid_get_cell_mirror(grid, axis,
+        grid_get_cell_abs(grid, hshg_abs(x)));
+}
+
+#endif /* HSHG_HASHED */
+
+
+#if defined(HSHG_HASHED)
+
+/*
+ * Mixes the coordinates with large primes, and then picks the highest bits of
+ * the result multiplied by the golden ratio, like the table of HSHG_SPARSE.
+ */
+hshg_attrib_const
+static _hshg_cell_sq_t
+grid_get_idx(const _hshg_grid* const grid, const hshg_coord_t x
+    _2D(, const hshg_coord_t y) _3D(, const hshg_coord_t z))
+{
+    const uint64_t key = (uint64_t) x * UINT64_C(73856093)
+    _2D(^ (uint64_t) y * UINT64_C(19349663))
+    _3D(^ (uint64_t) z * UINT64_C(83492791));
+
+    return (key * UINT64_C(0x9E3779B97F4A7C15)) >> (63 - grid->cells_log) >> 1;
+}
+
+#elif defined(HSHG_MORTON) && HSHG_D != 1
+
+/*
+ * Masks of bits of a Morton index belonging to every axis.
+ */
+#define HSHG_MORTON_X EXCL_2D(0x5555555555555555) EXCL_3D(0x1249249249249249)
+#define HSHG_MORTON_Y EXCL_2D(0xAAAAAAAAAAAAAAAA) EXCL_3D(0x2492492492492492)
+#define HSHG_MORTON_Z 0x4924924924924924
+
+
+hshg_attrib_const
+static uint64_t
+hshg_morton_spread(uint64_t x)
+{
+#ifdef __BMI2__
+    return __builtin_ia32_pdep_di(x, HSHG_MORTON_X);
+#else
+EXCL_2D(
+    x &= 0x00000000FFFFFFFF;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFF;
+    x = (x | (x <<  8)) & 0x00FF00FF00FF00FF;
+    x = (x | (x <<  4)) & 0x0F0F0F0F0F0F0F0F;
+    x = (x | (x <<  2)) & 0x3333333333333333;
+    x = (x | (x <<  1)) & 0x5555555555555555;
+)
+EXCL_3D(
+    x &= 0x00000000001FFFFF;
+    x = (x | (x << 32)) & 0x001F00000000FFFF;
+    x = (x | (x << 16)) & 0x001F0000FF0000FF;
+    x = (x | (x <<  8)) & 0x100F00F00F00F00F;
+    x = (x | (x <<  4)) & 0x10C30C30C30C30C3;
+    x = (x | (x <<  2)) & 0x1249249249249249;
+)
+    return x;
+#endif
+}
+
+
+hshg_attrib_const
+static uint64_t
+hshg_morton_compact(uint64_t x)
+{
+#ifdef __BMI2__
+    return __builtin_ia32_pext_di(x, HSHG_MORTON_X);
+#else
+EXCL_2D(
+    x &= 0x5555555555555555;
+    x = (x | (x >>  1)) & 0x3333333333333333;
+    x = (x | (x >>  2)) & 0x0F0F0F0F0F0F0F0F;
+    x = (x | (x >>  4)) & 0x00FF00FF00FF00FF;
+    x = (x | (x >>  8)) & 0x0000FFFF0000FFFF;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFF;
+)
+EXCL_3D(
+    x &= 0x1249249249249249;
+    x = (x | (x >>  2)) & 0x10C30C30C30C30C3;
+    x = (x | (x >>  4)) & 0x100F00F00F00F00F;
+    x = (x | (x >>  8)) & 0x001F0000FF0000FF;
+    x = (x | (x >> 16)) & 0x001F00000000FFFF;
+    x = (x | (x >> 32)) & 0x00000000001FFFFF;
+)
+    return x;
+#endif
+}
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+grid_get_idx(const _hshg_grid* const grid, const _hshg_cell_sq_t x
+    _2D(, const _hshg_cell_sq_t y) _3D(, const _hshg_cell_sq_t z))
+{
+    (void) grid;
+
+    return hshg_morton_spread(x)
+    _2D( | (hshg_morton_spread(y) << 1)) _3D( | (hshg_morton_spread(z) << 2));
+}
+
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_x(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return hshg_morton_compact(cell);
+}
+
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_y(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return hshg_morton_compact(cell >> 1);
+}
+
+
+_3D(
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_z(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return hshg_morton_compact(cell >> 2);
+}
+
+)
+
+
+/*
+ * Moving to a neighbouring cell only changes the bits of one axis, so the
+ * carry or borrow is propagated through the bits of other axes by filling
+ * them with ones or zeros for the duration of the addition.
+ */
+#define hshg_morton_inc(cell, mask) \
+    ((((cell) | (_hshg_cell_sq_t) ~(mask)) + 1) & (mask)) | ((cell) & ~(mask))
+
+#define hshg_morton_dec(cell, mask) \
+    ((((cell) & (_hshg_cell_sq_t) (mask)) - 1) & (mask)) | ((cell) & ~(mask))
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_inc_x(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return hshg_morton_inc(cell, HSHG_MORTON_X);
+}
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_dec_x(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return hshg_morton_dec(cell, HSHG_MORTON_X);
+}
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_inc_y(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return hshg_morton_inc(cell, HSHG_MORTON_Y);
+}
+
+
+_3D(
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_dec_y(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return hshg_morton_dec(cell, HSHG_MORTON_Y);
+}
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_dec_z(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return hshg_morton_dec(cell, HSHG_MORTON_Z);
+}
+
+)
+
+#undef hshg_morton_inc
+#undef hshg_morton_dec
+
+#elif defined(HSHG_GHOST)
+
+/*
+ * Like below, but with a border of one cell on every side, so rows and layers
+ * are 2 cells longer and no longer powers of 2.
+ */
+hshg_attrib_const
+static _hshg_cell_sq_t
+grid_get_idx(const _hshg_grid* const grid, const _hshg_cell_sq_t x
+    _2D(, const _hshg_cell_sq_t y) _3D(, const _hshg_cell_sq_t z))
+{
+    (void) grid;
+
+    return (x + 1)
+    _2D(+ (y + 1) * grid->stride_y) _3D(+ (z + 1) * grid->stride_z);
+}
+
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_x(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return EXCL_1D(cell) _2D(cell % grid->stride_y) - 1;
+}
+
+_2D(
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_y(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    return (cell _3D(% grid->stride_z)) / grid->stride_y - 1;
+}
+
+)
+
+_3D(
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_z(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    return cell / grid->stride_z - 1;
+}
+
+)
+
+#else
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+grid_get_idx(const _hshg_grid* const grid, const _hshg_cell_sq_t x
+    _2D(, const _hshg_cell_sq_t y) _3D(, const _hshg_cell_sq_t z))
+{
+    return x _2D( | (y << grid->cells2d_log)) _3D( | (z << grid->cells3d_log));
+}
+
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_x(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    return cell & grid->cells_mask[0];
+}
+
+
+_2D(
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_y(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    return (cell >> grid->cells2d_log) _3D( & grid->cells_mask[1]);
+}
+
+)
+
+
+_3D(
+
+hshg_attrib_const
+static _hshg_cell_t
+idx_get_z(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    return cell >> grid->cells3d_log;
+}
+
+)
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_inc_x(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return cell + 1;
+}
+
+
+_2D(
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_dec_x(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    (void) grid;
+
+    return cell - 1;
+}
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_inc_y(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    return cell + grid->cells_side[0];
+}
+
+)
+
+
+_3D(
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_dec_y(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    return cell - grid->cells_side[0];
+}
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+idx_dec_z(const _hshg_grid* const grid, const _hshg_cell_sq_t cell)
+{
+    return cell - grid->cells_sq;
+}
+
+)
+
+#endif /* HSHG_MORTON */
+
+
+hshg_attrib_const
+static _hshg_cell_sq_t
+grid_get_cell(const _hshg_grid* const grid, const _hshg_pos_t x
+    _2D(, const _hshg_pos_t y) _3D(, const _hshg_pos_t z))
+{
+    const hshg_coord_t cell_x = grid_get_cell_1d(grid, 0, x);
+_2D(const hshg_coord_t cell_y = grid_get_cell_1d(grid, 1, y);)
+_3D(const hshg_coord_t cell_z = grid_get_cell_1d(grid, 2, z);)
+
+    return grid_get_idx(grid, cell_x _2D(, cell_y) _3D(, cell_z));
+}
+
+
+#ifdef HSHG_LOOSE
+
+hshg_attrib_const
+static int
+grid_cell_holds_1d(const _hshg_grid* const grid, const uint8_t axis,
+    const _hshg_cell_t cell, const _hshg_pos_t x)
+{
+    return
+        grid_get_cell_1d(grid, axis, x - grid->loose_margin) == cell ||
+        grid_get_cell_1d(grid, axis, x + grid->loose_margin) == cell;
+}
+
+
+/*
+ * Whether an entity at the given position may stay in the given cell, which
+ * is when the cell is at most loose_margin away from it on every axis.
+ */
+hshg_attrib_const
+static int
+grid_cell_holds(const _hshg_grid* const grid, const _hshg_cell_sq_t cell,
+    const _hshg_pos_t x _2D(, const _hshg_pos_t y) _3D(, const _hshg_pos_t z))
+{
+    return grid_cell_holds_1d(grid, 0, idx_get_x(grid, cell), x)
+    _2D(&& grid_cell_holds_1d(grid, 1, idx_get_y(grid, cell), y))
+    _3D(&& grid_cell_holds_1d(grid, 2, idx_get_z(grid, cell), z));
+}
+
+#endif /* HSHG_LOOSE */
+
+
+hshg_attrib_const
+static uint8_t
+hshg_get_grid(const _hshg* const hshg, const _hshg_pos_t r)
+{
+#ifdef HSHG_LOOSE
+    /*
+     * Entities may be up to a quarter of a cell out of their cell, so they
+     * need cells twice as big for neighbouring cells to still cover them.
+     */
+    const uint32_t rounded = _HSHG_FLOAT(r * 4)
+        _HSHG_INTEGER(min((uint64_t) r * 4, (uint64_t) UINT32_MAX));
+#else
+    /*
+     * Integer radii can be up to INT32_MAX, twice which only fits unsigned.
+     */
+    const uint32_t rounded = _HSHG_FLOAT(r + r)
+        _HSHG_INTEGER((uint32_t) r + (uint32_t) r);
+#endif
+
+#ifdef HSHG_STATIC_SIDE
+    (void) hshg;
+
+    const uint32_t cell_size = HSHG_STATIC_CELL_SIZE;
+    const uint8_t cell_log = 31 - __builtin_ctz(HSHG_STATIC_CELL_SIZE);
+    const uint8_t grids_len = HSHG_STATIC_GRIDS_LEN;
+#else
+    const uint32_t cell_size = hshg->cell_size;
+    const uint8_t cell_log = hshg->cell_log;
+    const uint8_t grids_len = hshg->grids_len;
+#endif
+
+    if(rounded < cell_size)
+    {
+        return 0;
+    }
+
+    const uint8_t grid = cell_log - __builtin_clz(rounded) + 1;
+
+    return min(grid, grids_len - 1);
+}
+
+
+/*
+ * Puts the entity at the front of the cell it says it's in. Doesn't touch the
+ * grid itself, nor the unused entity 0, so threads can do it at the same time
+ * for different cells.
+ */
+static void
+hshg_link(_hshg* const hshg, const _hshg_entity_t idx)
+{
+    _hshg_entity* const entity = hshg->entities + idx;
+    const _hshg_grid* const grid = hshg->grids + entity->grid;
+
+    _hshg_entity_t* const cell = hshg_cell_ptr(hshg, grid, entity->cell);
+
+    entity->next = *cell;
+
+    if(entity->next == 0)
+    {
+        hshg_cell_set_used(hshg, cell - hshg->cells);
+    }
+_HSHG_PREV(
+    else
+    {
+        hshg->entities[entity->next].prev = idx;
+    }
+
+    entity->prev = 0;
+)
+    *cell = idx;
+}
+
+
+static void
+hshg_reinsert(_hshg* const hshg, const _hshg_entity_t idx)
+{
+    _hshg_entity* const entity = hshg->entities + idx;
+    _hshg_grid* const grid = hshg->grids + entity->grid;
+
+    entity->cell = grid_get_cell(grid,
+        entity->x _2D(, entity->y) _3D(, entity->z));
+
+    hshg_link(hshg, idx);
+_HSHG_CSR(hshg->csr = 0;)
+
+    if(grid->entities_len == 0)
+    {
+        hshg->new_cache |= UINT32_C(1) << entity->grid;
+    }
+
+    ++grid->entities_len;
+}
+
+
+int
+_hshg_insert(_hshg* const hshg, const _hshg_pos_t x _2D(, const _hshg_pos_t y)
+    _3D(, const _hshg_pos_t z), const _hshg_pos_t r, const _hshg_entity_t ref
+    _HSHG_USER(, const _hshg_user_t user))
+{
+    assert(!hshg->calling &&
+        "hshg_insert() may not be called from any callback");
+
+    const _hshg_entity_t idx = hshg_get_entity(hshg);
+
+    if(idx == 0)
+    {
+        return -1;
+    }
+
+    _hshg_entity* const ent = hshg->entities + idx;
+
+    ent->grid = hshg_get_grid(hshg, r);
+    ent->ref = ref;
+    ent->x = x;
+_2D(ent->y = y;)
+_3D(ent->z = z;)
+    ent->r = r;
+_HSHG_USER(ent->user = user;)
+_HSHG_SLEEP(ent->asleep = 0;)
+
+    hshg_reinsert(hshg, idx);
+_HSHG_SLEEP(hshg_awake_set(hshg, idx);)
+
+    return 0;
+}
+
+
+/*
+ * Takes the entity out of its cell. Like hshg_link(), leaves the grid alone.
+ */
+static void
+hshg_unlink(_hshg* const hshg, const _hshg_entity_t idx)
+{
+    const _hshg_entity* const entity = hshg->entities + idx;
+    const _hshg_grid* const grid = hshg->grids + entity->grid;
+    const _hshg_entity_t prev = hshg_get_prev(hshg, idx);
+
+    if(prev == 0)
+    {
+        if(entity->next == 0)
+        {
+            hshg_cell_clear(hshg, grid, entity->cell);
+        }
+        else
+        {
+            *hshg_cell_ptr(hshg, grid, entity->cell) = entity->next;
+        }
+    }
+    else
+    {
+        hshg->entities[prev].next = entity->next;
+    }
+
+_HSHG_PREV(
+    if(entity->next != 0)
+    {
+        hshg->entities[entity->next].prev = prev;
+    }
+)
+}
+
+
+static void
+hshg_remove_light(_hshg* const hshg)
+{
+    const _hshg_entity* const entity = hshg->entities + hshg->entity_id;
+    _hshg_grid* const grid = hshg->grids + entity->grid;
+
+    hshg_unlink(hshg, hshg->entity_id);
+_HSHG_CSR(hshg->csr = 0;)
+
+    --grid->entities_len;
+
+    if(grid->entities_len == 0)
+    {
+        hshg->new_cache ^= UINT32_C(1) << entity->grid;
+    }
+}
+
+
+void
+_hshg_remove(_hshg* const hshg)
+{
+    assert(hshg->updating &&
+        "hshg_remove() may only be called from within hshg.update()");
+
+    hshg_set(removed, 1);
+
+    hshg_remove_light(hshg);
+    hshg_return_entity(hshg);
+}
+
+
+void
+_hshg_move(_hshg* const hshg)
+{
+    assert(hshg->updating &&
+        "hshg_move() may only be called from within hshg.update()");
+
+    const _hshg_entity_t idx = hshg->entity_id;
+    _hshg_entity* const entity = hshg->entities + idx;
+    const _hshg_grid* const grid = hshg->grids + entity->grid;
+
+    const _hshg_cell_sq_t new_cell =
+        grid_get_cell(grid, entity->x _2D(, entity->y) _3D(, entity->z));
+
+    if(entity->cell != new_cell _HSHG_LOOSE(&& !grid_cell_holds(grid,
+        entity->cell, entity->x _2D(, entity->y) _3D(, entity->z))))
+    {
+        hshg_remove_light(hshg);
+        hshg_reinsert(hshg, idx);
+    }
+}
+
+
+void
+_hshg_resize(_hshg* const hshg)
+{
+    assert(hshg->updating &&
+        "hshg_resize() may only be called from within hshg.update()");
+
+    const _hshg_entity_t idx = hshg->entity_id;
+    _hshg_entity* const entity = hshg->entities + idx;
+    const uint8_t new_grid = hshg_get_grid(hshg, entity->r);
+
+    if(entity->grid != new_grid)
+    {
+        hshg_remove_light(hshg);
+
+        entity->grid = new_grid;
+
+        hshg_reinsert(hshg, idx);
+    }
+}
+
+
+void
+_hshg_rebase(_hshg* const hshg, const _hshg_pos_t x
+    _2D(, const _hshg_pos_t y) _3D(, const _hshg_pos_t z))
+{
+    assert(!hshg->calling &&
+        "hshg_rebase() may not be called from any callback");
+
+    _hshg_entity* entity = hshg->entities;
+
+#define i hshg->entity_id
+
+    for(i = 1; i < hshg->entities_used; ++i)
+    {
+        ++entity;
+
+        if(invalid_entity(entity))
+        {
+            continue;
+        }
+
+        entity->x -= x;
+    _2D(entity->y -= y;)
+    _3D(entity->z -= z;)
+
+        const _hshg_grid* const grid = hshg->grids + entity->grid;
+
+        const _hshg_cell_sq_t new_cell =
+            grid_get_cell(grid, entity->x _2D(, entity->y) _3D(, entity->z));
+
+        if(entity->cell != new_cell _HSHG_LOOSE(&& !grid_cell_holds(grid,
+            entity->cell, entity->x _2D(, entity->y) _3D(, entity->z))))
+        {
+            hshg_remove_light(hshg);
+            hshg_reinsert(hshg, i);
+        }
+    }
+
+#undef i
+}
+
+
+void
+_hshg_update(_hshg* const hshg)
+{
+    assert(hshg->update);
+    assert(!hshg->calling &&
+        "hshg_update() may not be called from any callback");
+
+    hshg_set(updating, 1);
+
+#define i hshg->entity_id
+
+#ifdef HSHG_SLEEP
+    const _hshg_entity_t awake_len = hshg_cells_used_len(hshg->entities_used);
+
+    for(_hshg_entity_t word = 0; word < awake_len; ++word)
+    {
+        uint64_t bits = hshg->awake[word];
+
+        while(bits != 0)
+        {
+            const uint8_t bit = __builtin_ctzll(bits);
+
+            i = (word << 6) | bit;
+
+            hshg->update(hshg, hshg->entities + i);
+
+            /*
+             * The callback may have put any entity to sleep or woken it up,
+             * so the rest of the word is read again.
+             */
+            bits = hshg->awake[word] & -(UINT64_C(2) << bit);
+        }
+    }
+#else
+    _hshg_entity* entity = hshg->entities;
+
+    for(i = 1; i < hshg->entities_used; ++i)
+    {
+        ++entity;
+
+        if(invalid_entity(entity))
+        {
+            continue;
+        }
+
+        hshg->update(hshg, entity);
+    }
+#endif /* HSHG_SLEEP */
+
+#undef i
+
+    hshg_set(removed, 0);
+    hshg_set(updating, 0);
+}
+
+
+#ifdef HSHG_SLEEP
+
+void
+_hshg_sleep(const _hshg* const hshg, const _hshg_entity* const entity)
+{
+    assert(!invalid_entity(entity));
+
+    const _hshg_entity_t idx = entity - hshg->entities;
+
+    hshg->entities[idx].asleep = 1;
+    hshg_awake_set(hshg, idx);
+}
+
+
+void
+_hshg_wake(const _hshg* const hshg, const _hshg_entity* const entity)
+{
+    assert(!invalid_entity(entity));
+
+    const _hshg_entity_t idx = entity - hshg->entities;
+
+    hshg->entities[idx].asleep = 0;
+    hshg_awake_set(hshg, idx);
+}
+
+#endif /* HSHG_SLEEP */
+
+
+/*
+ * First entity updated by the given thread. Threads are split on word
+ * boundaries of the bitmaps of removed and awake entities, so that they never
+ * write to the same word of them.
+ */
+hshg_attrib_const
+static _hshg_entity_t
+hshg_update_start(const _hshg_entity_t used,
+    const uint8_t threads, const uint8_t idx)
+{
+    const uint64_t words = ((uint64_t) used + 63) >> 6;
+
+    return max((words * idx / threads) << 6, UINT64_C(1));
+}
+
+
+void
+_hshg_update_multithread(const _hshg* const hshg,
+    const uint8_t threads, const uint8_t idx)
+{
+    assert(hshg->const_update);
+
+    const _hshg_entity_t used = hshg->entities_used;
+    const _hshg_entity_t first = hshg_update_start(used, threads, idx);
+    const _hshg_entity_t last = idx + 1 == threads ? used :
+        hshg_update_start(used, threads, idx + 1);
+
+    for(_hshg_entity_t i = first; i < last; ++i)
+    {
+    _HSHG_SLEEP(
+        i = hshg_awake_next(hshg, i, last);
+
+        if(i == last)
+        {
+            break;
+        }
+    )
+        _hshg_entity* const entity = hshg->entities + i;
+
+        if(invalid_entity(entity))
+        {
+            continue;
+        }
+
+        hshg->const_update(hshg, entity);
+    }
+}
+
+
+/*
+ * Sets bits of new_cache from scratch, for when many grids may have become
+ * empty or non-empty at once.
+ */
+static void
+hshg_recache(_hshg* const hshg)
+{
+    hshg->new_cache = 0;
+
+    for(uint8_t g = 0; g < hshg->grids_len; ++g)
+    {
+        if(hshg->grids[g].entities_len != 0)
+        {
+            hshg->new_cache |= UINT32_C(1) << g;
+        }
+    }
+}
+
+
+/*
+ * Whether the entity has to be linked to another cell, because it moved or
+ * was resized since it was last linked.
+ */
+static int
+hshg_needs_relink(const _hshg* const hshg, const _hshg_entity* const entity,
+    const uint8_t new_grid)
+{
+    if(entity->grid != new_grid)
+    {
+        return 1;
+    }
+
+    const _hshg_grid* const grid = hshg->grids + new_grid;
+
+    const _hshg_cell_sq_t new_cell =
+        grid_get_cell(grid, entity->x _2D(, entity->y) _3D(, entity->z));
+
+    return entity->cell != new_cell _HSHG_LOOSE(&& !grid_cell_holds(grid,
+        entity->cell, entity->x _2D(, entity->y) _3D(, entity->z)));
+}
+
+
+/*
+ * Whether the given cell falls in the range of cells of a thread. With
+ * HSHG_SPARSE, cells only get their slots in the table as they are linked,
+ * so a thread either has all of them or none.
+ */
+static int
+hshg_cell_in_range(const _hshg* const hshg, const _hshg_grid* const grid,
+    const _hshg_cell_sq_t cell, const _hshg_cell_sq_t start,
+    const _hshg_cell_sq_t end)
+{
+#ifdef HSHG_SPARSE
+    (void) hshg;
+    (void) grid;
+    (void) cell;
+
+    return start != end;
+#else
+    const _hshg_cell_sq_t idx = grid->cells - hshg->cells + cell;
+
+    return idx >= start && idx < end;
+#endif
+}
+
+
+static int
+hshg_entity_removed(const _hshg* const hshg, const _hshg_entity_t idx)
+{
+    return (hshg->update_removed[idx >> 6] >> (idx & 63)) & 1;
+}
+
+
+/*
+ * Copies the position and, if given, the radius of the entity from the arrays
+ * of hshg_sync_positions(), indexed by its ref.
+ */
+static void
+hshg_sync_entity(_hshg_entity* const entity, const _hshg_pos_t* const xs
+    _2D(, const _hshg_pos_t* const ys) _3D(, const _hshg_pos_t* const zs),
+    const _hshg_pos_t* const rs)
+{
+    const _hshg_entity_t ref = entity->ref;
+
+    entity->x = xs[ref];
+_2D(entity->y = ys[ref];)
+_3D(entity->z = zs[ref];)
+
+    if(rs != NULL)
+    {
+        entity->r = rs[ref];
+    }
+}
+
+
+/*
+ * Entities are updated with hshg.const_update, unless `xs` is given, in which
+ * case they are synced from the arrays instead.
+ */
+static int
+hshg_relink_multithread(_hshg* const hshg,
+    const uint8_t threads, const uint8_t idx, const _hshg_pos_t* const xs
+    _2D(, const _hshg_pos_t* const ys) _3D(, const _hshg_pos_t* const zs),
+    const _hshg_pos_t* const rs)
+{
+    assert(hshg->barrier);
+
+    /*
+     * Every thread has a row of counts, the first two of which are where its
+     * commands start and end, and the rest are changes in numbers of entities
+     * of every grid. Commands of a thread go where its entities start, since
+     * it can't record more of them than it has entities.
+     */
+    const uint8_t row_len = hshg->grids_len + 2;
+
+    if(idx == 0)
+    {
+        if(threads > hshg->update_threads)
+        {
+            _hshg_entity_t* const update_counts = hshg_mem_realloc(
+                &hshg->allocator, hshg->update_counts,
+                sizeof(_hshg_entity_t) * threads * row_len, hshg_align);
+
+            /*
+             * A missing buffer tells all threads that there's no memory.
+             */
+            if(update_counts == NULL)
+            {
+                hshg_mem_free(&hshg->allocator, hshg->update_counts);
+
+                hshg->update_threads = 0;
+            }
+            else
+            {
+                hshg->update_threads = threads;
+            }
+
+            hshg->update_counts = update_counts;
+        }
+
+        if(hshg->update_counts != NULL)
+        {
+            (void) memset(hshg->update_counts, 0,
+                sizeof(_hshg_entity_t) * threads * row_len);
+
+            /* Nothing is allocated before the first entity is inserted */
+            if(hshg->update_removed != NULL)
+            {
+                (void) memset(hshg->update_removed, 0, sizeof(uint64_t) *
+                    hshg_cells_used_len(hshg->entities_used));
+            }
+
+            hshg->relinking = 1;
+        _HSHG_CSR(hshg->csr = 0;)
+        }
+    }
+
+    hshg->barrier(hshg);
+
+    if(hshg->update_counts == NULL)
+    {
+        /*
+         * Thread 0 may not start the next call before every thread saw this.
+         */
+        hshg->barrier(hshg);
+
+        return -1;
+    }
+
+    _hshg_entity_t* const commands = hshg->update_commands;
+    const _hshg_entity_t used = hshg->entities_used;
+    const _hshg_entity_t first = hshg_update_start(used, threads, idx);
+    const _hshg_entity_t last = idx + 1 == threads ? used :
+        hshg_update_start(used, threads, idx + 1);
+
+    _hshg_entity_t* const counts = hshg->update_counts + idx * row_len;
+    _hshg_entity_t* const deltas = counts + 2;
+
+    counts[0] = first;
+    counts[1] = first;
+
+    for(_hshg_entity_t i = first; i < last; ++i)
+    {
+    _HSHG_SLEEP(
+        /*
+         * Sleeping entities are only skipped when updating, since synced
+         * positions may move them too.
+         */
+        if(xs == NULL)
+        {
+            i = hshg_awake_next(hshg, i, last);
+
+            if(i == last)
+            {
+                break;
+            }
+        }
+    )
+        _hshg_entity* const entity = hshg->entities + i;
+
+        if(invalid_entity(entity))
+        {
+            continue;
+        }
+
+        if(xs == NULL)
+        {
+            hshg->const_update(hshg, entity);
+        }
+        else
+        {
+            hshg_sync_entity(entity, xs _2D(, ys) _3D(, zs), rs);
+        }
+
+        const int removed = hshg_entity_removed(hshg, i);
+        const uint8_t new_grid = hshg_get_grid(hshg, entity->r);
+
+        if(!removed && !hshg_needs_relink(hshg, entity, new_grid))
+        {
+            continue;
+        }
+
+        commands[counts[1]++] = i;
+
+        --deltas[entity->grid];
+
+        if(!removed)
+        {
+            ++deltas[new_grid];
+        }
+    }
+
+    hshg->barrier(hshg);
+
+#ifdef HSHG_SPARSE
+    const _hshg_cell_sq_t start = 0;
+    const _hshg_cell_sq_t end = idx == 0 ? hshg->cells_len : 0;
+#else
+    const uint64_t words = hshg_cells_used_len(hshg->cells_len);
+    const _hshg_cell_sq_t start = (words * idx / threads) << 6;
+    const _hshg_cell_sq_t end =
+        min((words * (idx + 1) / threads) << 6, (uint64_t) hshg->cells_len);
+#endif
+
+#define for_each_command(cmd)                                   \
+    for(uint8_t t = 0; t < threads; ++t)                        \
+        for(const _hshg_entity_t* cmd =                         \
+            commands + hshg->update_counts[t * row_len];        \
+            cmd != commands + hshg->update_counts[t * row_len + 1]; ++cmd)
+
+    /*
+     * Entities are first taken out of their old cells, and only then put in
+     * their new ones, because the same cell may be owned by one thread as an
+     * old cell and by another as a new cell.
+     */
+    for_each_command(cmd)
+    {
+        const _hshg_entity* const entity = hshg->entities + *cmd;
+
+        if(hshg_cell_in_range(hshg, hshg->grids + entity->grid,
+            entity->cell, start, end))
+        {
+            hshg_unlink(hshg, *cmd);
+        }
+    }
+
+    hshg->barrier(hshg);
+
+    /*
+     * Other threads look at old cells of all entities until they are all
+     * unlinked, so new ones can only be written now, each thread doing its own.
+     */
+    for(_hshg_entity_t i = counts[0]; i < counts[1]; ++i)
+    {
+        const _hshg_entity_t j = commands[i];
+        _hshg_entity* const entity = hshg->entities + j;
+
+        if(hshg_entity_removed(hshg, j))
+        {
+            continue;
+        }
+
+        entity->grid = hshg_get_grid(hshg, entity->r);
+        entity->cell = grid_get_cell(hshg->grids + entity->grid,
+            entity->x _2D(, entity->y) _3D(, entity->z));
+    }
+
+    hshg->barrier(hshg);
+
+    for_each_command(cmd)
+    {
+        const _hshg_entity_t j = *cmd;
+        const _hshg_entity* const entity = hshg->entities + j;
+
+        if(hshg_entity_removed(hshg, j) || !hshg_cell_in_range(hshg,
+            hshg->grids + entity->grid, entity->cell, start, end))
+        {
+            continue;
+        }
+
+        hshg_link(hshg, j);
+    }
+
+    hshg->barrier(hshg);
+
+    if(idx == 0)
+    {
+        for(uint8_t t = 0; t < threads; ++t)
+        {
+            for(uint8_t g = 0; g < hshg->grids_len; ++g)
+            {
+                hshg->grids[g].entities_len +=
+                    hshg->update_counts[t * row_len + 2 + g];
+            }
+        }
+
+        hshg_recache(hshg);
+
+        for_each_command(cmd)
+        {
+            if(hshg_entity_removed(hshg, *cmd))
+            {
+                hshg->entity_id = *cmd;
+                hshg_return_entity(hshg);
+            }
+        }
+
+        hshg->relinking = 0;
+    }
+
+#undef for_each_command
+
+    hshg->barrier(hshg);
+
+    return 0;
+}
+
+
+int
+_hshg_update_relink_multithread(_hshg* const hshg,
+    const uint8_t threads, const uint8_t idx)
+{
+    assert(hshg->const_update);
+    assert(!hshg->calling &&
+        "hshg_update_relink_multithread() may not be called from any callback");
+
+    return hshg_relink_multithread(hshg, threads, idx,
+        NULL _2D(, NULL) _3D(, NULL), NULL);
+}
+
+
+void
+_hshg_remove_multithread(const _hshg* const hshg,
+    const _hshg_entity* const entity)
+{
+    assert(hshg->relinking &&
+        "hshg_remove_multithread() may only be called from within "
+        "hshg.const_update() during hshg_update_relink_multithread()");
+
+    const _hshg_entity_t idx = entity - hshg->entities;
+
+    hshg->update_removed[idx >> 6] |= UINT64_C(1) << (idx & 63);
+}
+
+
+void
+_hshg_sync_positions(_hshg* const hshg, const _hshg_pos_t* const xs
+    _2D(, const _hshg_pos_t* const ys) _3D(, const _hshg_pos_t* const zs),
+    const _hshg_pos_t* const rs)
+{
+    assert(!hshg->calling &&
+        "hshg_sync_positions() may not be called from any callback");
+
+    _hshg_entity* entity = hshg->entities;
+
+#define i hshg->entity_id
+
+    for(i = 1; i < hshg->entities_used; ++i)
+    {
+        ++entity;
+
+        if(invalid_entity(entity))
+        {
+            continue;
+        }
+
+        hshg_sync_entity(entity, xs _2D(, ys) _3D(, zs), rs);
+
+        const uint8_t new_grid = hshg_get_grid(hshg, entity->r);
+
+        if(hshg_needs_relink(hshg, entity, new_grid))
+        {
+            hshg_remove_light(hshg);
+
+            entity->grid = new_grid;
+
+            hshg_reinsert(hshg, i);
+        }
+    }
+
+#undef i
+}
+
+
+int
+_hshg_sync_positions_multithread(_hshg* const hshg,
+    const uint8_t threads, const uint8_t idx, const _hshg_pos_t* const xs
+    _2D(, const _hshg_pos_t* const ys) _3D(, const _hshg_pos_t* const zs),
+    const _hshg_pos_t* const rs)
+{
+    assert(xs);
+    assert(!hshg->calling &&
+        "hshg_sync_positions_multithread() may not be called "
+        "from any callback");
+
+    return hshg_relink_multithread(hshg, threads, idx,
+        xs _2D(, ys) _3D(, zs), rs);
+}
+
+
+void
+_hshg_update_cache(_hshg* const hshg)
+{
+    if(hshg->old_cache == hshg->new_cache)
+    {
+        return;
+    }
+
+    hshg->old_cache = hshg->new_cache;
+
+    _hshg_grid* old_grid;
+    const _hshg_grid* const grid_max = hshg->grids + hshg->grids_len;
+
+    for(old_grid = hshg->grids; old_grid != grid_max; ++old_grid)
+    {
+        old_grid->shift = 0;
+    }
+
+    old_grid = hshg->grids;
+
+    while(1)
+    {
+        if(old_grid == grid_max)
+        {
+            return;
+        }
+
+        if(old_grid->entities_len != 0)
+        {
+            break;
+        }
+
+        ++old_grid;
+    }
+
+    _hshg_grid* new_grid;
+
+    uint8_t shift = 1;
+
+    for(new_grid = old_grid + 1; new_grid != grid_max; ++new_grid)
+    {
+        if(new_grid->entities_len == 0)
+        {
+            ++shift;
+
+            continue;
+        }
+
+        old_grid->shift = shift;
+        old_grid = new_grid;
+        shift = 1;
+    }
+}
+
+
+/*
+ * Where the range of the given entity's cell ends, or 0 if cells aren't kept
+ * as ranges right now and have to be walked through their lists.
+ */
+hshg_attrib_always_inline
+static inline _hshg_entity_t
+hshg_csr_end(const _hshg* const hshg, const _hshg_entity_t i)
+{
+#ifdef HSHG_CSR
+    return hshg->csr && i != 0 ? hshg->csr_ends[i] : 0;
+#else
+    (void) hshg;
+    (void) i;
+
+    return 0;
+#endif
+}
+
+
+/*
+ * The entity after the given one in its cell. Within a range, that's simply
+ * the next index, which doesn't have to wait for the entity to be loaded.
+ */
+hshg_attrib_always_inline
+static inline _hshg_entity_t
+hshg_csr_next(const _hshg_entity* const entity, const _hshg_entity_t i,
+    const _hshg_entity_t end)
+{
+#ifdef HSHG_CSR
+    if(end != 0)
+    {
+        return i + 1 != end ? i + 1 : 0;
+    }
+#else
+    (void) i;
+    (void) end;
+#endif
+
+    return entity->next;
+}
+
+
+/*
+ * Prefetches the entity after the given one in its cell, so that it's on its
+ * way while the callback runs. Within a range, it can be further ahead.
+ */
+hshg_attrib_always_inline
+static inline void
+hshg_prefetch_next(const _hshg* const hshg, const _hshg_entity* const entity,
+    const _hshg_entity_t i, const _hshg_entity_t end)
+{
+#ifdef HSHG_PREFETCH
+    if(end == 0)
+    {
+        __builtin_prefetch(hshg->entities + entity->next);
+    }
+    else if(end - i > HSHG_PREFETCH)
+    {
+        __builtin_prefetch(hshg->entities + i + HSHG_PREFETCH);
+    }
+#else
+    (void) hshg;
+    (void) entity;
+    (void) i;
+    (void) end;
+#endif
+}
+
+
+#ifdef HSHG_HASHED
+
+/*
+ * Calls the collision callback for the entity and every following entity that
+ * is in the cell at the given coordinates. Entities of other cells that share
+ * the same index are skipped, unless the grid has only one cell anyway.
+ */
+static void
+hshg_collide_cell(_hshg* const hshg, const _hshg_entity* const entity,
+    const _hshg_grid* const grid, _hshg_entity_t i, const hshg_coord_t x
+    _2D(, const hshg_coord_t y) _3D(, const hshg_coord_t z))
+{
+    const _hshg_entity_t end = hshg_csr_end(hshg, i);
+
+    while(i != 0)
+    {
+        const _hshg_entity* const ent = hshg->entities + i;
+
+        hshg_prefetch_next(hshg, ent, i, end);
+
+        if(grid->cells_log == 0 || (
+            grid_get_cell_1d(grid, 0, ent->x) == x _2D(&&
+            grid_get_cell_1d(grid, 1, ent->y) == y) _3D(&&
+            grid_get_cell_1d(grid, 2, ent->z) == z)
+        ))
+        {
+            hshg->collide(hshg, entity, ent);
+        }
+
+        i = hshg_csr_next(ent, i, end);
+    }
+}
+
+#endif /* HSHG_HASHED */
+
+
+#ifndef HSHG_HASHED
+
+#define loop_over(from)                                 \
+                                                        \
+do                                                      \
+{                                                       \
+    i = (from);                                         \
+                                                        \
+    const _hshg_entity_t end = hshg_csr_end(hshg, i);   \
+                                                        \
+    while(i != 0)                                       \
+    {                                                   \
+        ent = hshg->entities + i;                       \
+        hshg_prefetch_next(hshg, ent, i, end);          \
+                                                        \
+        hshg->collide(hshg, entity, ent);               \
+                                                        \
+        i = hshg_csr_next(ent, i, end);                 \
+    }                                                   \
+}                                                       \
+while(0)
+
+
+#if defined(HSHG_PREFETCH) && !defined(HSHG_SPARSE)
+
+/*
+ * Prefetches the head of the given cell. Neighbours of cells on the edge of the
+ * grid may not exist, so those are only skipped if they are out of the array.
+ */
+hshg_attrib_always_inline
+static inline void
+hshg_prefetch_cell(const _hshg* const hshg, const _hshg_grid* const grid,
+    const _hshg_cell_sq_t cell)
+{
+    const _hshg_cell_sq_t idx = grid->cells - hshg->cells + cell;
+
+    if(idx < hshg->cells_len)
+    {
+        __builtin_prefetch(hshg->cells + idx);
+    }
+}
+
+#endif
+
+
+/*
+ * Prefetches heads of the cells that hshg_collide() will visit in the grid of
+ * the entity HSHG_PREFETCH entities after the given one. Every row of them is
+ * mostly on one cache line, so only the middle of each row is prefetched,
+ * except for the row of the entity itself. In 1D that row is all there is.
+ */
+hshg_attrib_always_inline
+static inline void
+hshg_prefetch_cells(const _hshg* const hshg, const _hshg_entity* const entity,
+    const _hshg_entity* const entity_max)
+{
+#if defined(HSHG_PREFETCH) && !defined(HSHG_SPARSE)
+    const _hshg_entity* const ahead = entity + HSHG_PREFETCH;
+
+    if(ahead >= entity_max || invalid_entity(ahead))
+    {
+        return;
+    }
+
+    const _hshg_grid* const grid = hshg->grids + ahead->grid;
+
+#ifdef HSHG_GHOST
+    /* Rows of the stencil go from x - 1 to x + 1 */
+    for(uint8_t k = HSHG_STENCIL_LEN / 2 + 1; k < HSHG_STENCIL_LEN; ++k)
+    {
+        if(k % 3 == 1)
+        {
+            hshg_prefetch_cell(hshg, grid, ahead->cell + grid->stencil[k]);
+        }
+    }
+#else
+    (void) grid;
+_2D(
+    hshg_prefetch_cell(hshg, grid, idx_inc_y(grid, ahead->cell));
+)
+_3D(
+    const _hshg_cell_sq_t below = idx_dec_z(grid, ahead->cell);
+
+    hshg_prefetch_cell(hshg, grid, idx_dec_y(grid, below));
+    hshg_prefetch_cell(hshg, grid, below);
+    hshg_prefetch_cell(hshg, grid, idx_inc_y(grid, below));
+)
+#endif /* HSHG_GHOST */
+#else
+    (void) hshg;
+    (void) entity;
+    (void) entity_max;
+#endif
+}
+
+
+/*
+ * Prefetches the head of the entity's cell in the next grid up from the given
+ * one, so that it's on its way while the given grid is being visited.
+ */
+hshg_attrib_always_inline
+static inline void
+hshg_prefetch_up(const _hshg_grid* const grid, const _hshg_cell_t cell_x
+    _2D(, const _hshg_cell_t cell_y) _3D(, const _hshg_cell_t cell_z))
+{
+#if defined(HSHG_PREFETCH) && !defined(HSHG_SPARSE)
+    const uint8_t shift = grid->shift;
+
+    if(shift == 0)
+    {
+        return;
+    }
+
+    const _hshg_grid* const up = grid + shift;
+
+    __builtin_prefetch(up->cells + grid_get_idx(up, cell_x >> shift
+        _2D(, cell_y >> shift) _3D(, cell_z >> shift)));
+#else
+    (void) grid;
+    (void) cell_x;
+_2D((void) cell_y;)
+_3D((void) cell_z;)
+#endif
+}
+
+#ifndef HSHG_GHOST
+
+/*
+ * Collides the entity with everything in the grid around the given cell. The
+ * geometry of the grid is read from `geom`, which is `grid` itself, unless it
+ * is known at compile time thanks to HSHG_STATIC_SIDE.
+ */
+hshg_attrib_always_inline
+static inline void
+hshg_collide_around(_hshg* const hshg, const _hshg_entity* const entity,
+    const _hshg_grid* const grid, const _hshg_grid* const geom,
+    const _hshg_cell_t cell_x _2D(, const _hshg_cell_t cell_y)
+    _3D(, const _hshg_cell_t cell_z))
+{
+    _hshg_entity_t i;
+    const _hshg_entity* ent;
+
+    const _hshg_cell_t min_cell_x =
+        cell_x != 0 ? cell_x - 1 : 0;
+
+_2D(const _hshg_cell_t min_cell_y =
+        cell_y != 0 ? cell_y - 1 : 0;)
+
+_3D(const _hshg_cell_t min_cell_z =
+        cell_z != 0 ? cell_z - 1 : 0;)
+
+
+    const _hshg_cell_t max_cell_x =
+        cell_x != geom->cells_mask[0] ? cell_x + 1 : cell_x;
+
+_2D(const _hshg_cell_t max_cell_y =
+        cell_y != geom->cells_mask[1] ? cell_y + 1 : cell_y;)
+
+_3D(const _hshg_cell_t max_cell_z =
+        cell_z != geom->cells_mask[2] ? cell_z + 1 : cell_z;)
+
+
+    _hshg_cell_t cur_x;
+_2D(_hshg_cell_t cur_y;)
+_3D(_hshg_cell_t cur_z;)
+
+_3D(for(cur_z = min_cell_z; cur_z <= max_cell_z; ++cur_z))
+    {
+
+_2D(for(cur_y = min_cell_y; cur_y <= max_cell_y; ++cur_y))
+    {
+
+    for(cur_x = min_cell_x; cur_x <= max_cell_x; ++cur_x)
+    {
+        const _hshg_cell_sq_t cell =
+            grid_get_idx(geom, cur_x _2D(, cur_y) _3D(, cur_z));
+
+        loop_over(hshg_cell_get(hshg, grid, cell));
+    }
+
+    }
+
+    }
+}
+
+
+/*
+ * Collides the entity with everything after it in its own cell, neighbouring
+ * cells that come after its cell, and all neighbouring cells of upper grids.
+ */
+hshg_attrib_always_inline
+static inline void
+hshg_collide_entity(_hshg* const hshg, const _hshg_entity* const entity,
+    const _hshg_grid* grid, const _hshg_grid* const geom)
+{
+    _hshg_entity_t i;
+    const _hshg_entity* ent;
+
+    _hshg_cell_t cell_x = idx_get_x(geom, entity->cell);
+_2D(_hshg_cell_t cell_y = idx_get_y(geom, entity->cell);)
+_3D(_hshg_cell_t cell_z = idx_get_z(geom, entity->cell);)
+_3D(
+    if(cell_z != 0)
+    {
+        const _hshg_cell_sq_t below = idx_dec_z(geom, entity->cell);
+
+        if(cell_y != 0)
+        {
+            const _hshg_cell_sq_t cell = idx_dec_y(geom, below);
+
+            if(cell_x != 0)
+            {
+                loop_over(hshg_cell_get(hshg, grid, idx_dec_x(geom, cell)));
+            }
+
+            loop_over(hshg_cell_get(hshg, grid, cell));
+
+            if(cell_x != geom->cells_mask[0])
+            {
+                loop_over(hshg_cell_get(hshg, grid, idx_inc_x(geom, cell)));
+            }
+        }
+
+        {
+            const _hshg_cell_sq_t cell = below;
+
+            if(cell_x != 0)
+            {
+                loop_over(hshg_cell_get(hshg, grid, idx_dec_x(geom, cell)));
+            }
+
+            loop_over(hshg_cell_get(hshg, grid, cell));
+
+            if(cell_x != geom->cells_mask[0])
+            {
+                loop_over(hshg_cell_get(hshg, grid, idx_inc_x(geom, cell)));
+            }
+        }
+
+        if(cell_y != geom->cells_mask[1])
+        {
+            const _hshg_cell_sq_t cell = idx_inc_y(geom, below);
+
+            if(cell_x != 0)
+            {
+                loop_over(hshg_cell_get(hshg, grid, idx_dec_x(geom, cell)));
+            }
+
+            loop_over(hshg_cell_get(hshg, grid, cell));
+
+            if(cell_x != geom->cells_mask[0])
+            {
+                loop_over(hshg_cell_get(hshg, grid, idx_inc_x(geom, cell)));
+            }
+        }
+    }
+)
+    loop_over(entity->next);
+
+    if(cell_x != geom->cells_mask[0])
+    {
+        loop_over(hshg_cell_get(hshg, grid, idx_inc_x(geom, entity->cell)));
+    }
+_2D(
+    if(cell_y != geom->cells_mask[1])
+    {
+        const _hshg_cell_sq_t cell = idx_inc_y(geom, entity->cell);
+
+        if(cell_x != 0)
+        {
+            loop_over(hshg_cell_get(hshg, grid, idx_dec_x(geom, cell)));
+        }
+
+        loop_over(hshg_cell_get(hshg, grid, cell));
+
+        if(cell_x != geom->cells_mask[0])
+        {
+            loop_over(hshg_cell_get(hshg, grid, idx_inc_x(geom, cell)));
+        }
+    }
+)
+#ifdef HSHG_STATIC_SIDE
+    const uint8_t level = geom - hshg_static_grids;
+
+#pragma GCC unroll 32
+    for(uint8_t up = level + 1; up < HSHG_STATIC_GRIDS_LEN; ++up)
+    {
+        if(hshg->grids[up].entities_len == 0)
+        {
+            continue;
+        }
+
+        const uint8_t shift = up - level;
+
+        hshg_collide_around(hshg, entity, hshg->grids + up,
+            hshg_static_grids + up, cell_x >> shift
+            _2D(, cell_y >> shift) _3D(, cell_z >> shift));
+    }
+#else
+    while(grid->shift)
+    {
+        cell_x >>= grid->shift;
+    _2D(cell_y >>= grid->shift;)
+    _3D(cell_z >>= grid->shift;)
+
+        grid += grid->shift;
+
+        hshg_prefetch_up(grid, cell_x _2D(, cell_y) _3D(, cell_z));
+
+        hshg_collide_around(hshg, entity, grid, grid,
+            cell_x _2D(, cell_y) _3D(, cell_z));
+    }
+#endif /* HSHG_STATIC_SIDE */
+}
+
+#endif /* HSHG_GHOST */
+
+#endif /* HSHG_HASHED */
+
+
+void
+_hshg_collide(_hshg* const hshg)
+{
+    assert(hshg->collide);
+    assert(!hshg->calling &&
+        "hshg_collide() may not be called from any callback");
+
+    hshg_set(colliding, 1);
+
+    _hshg_update_cache(hshg);
+
+    const _hshg_entity* entity;
+    const _hshg_entity* const entity_max =
+        hshg->entities + hshg->entities_used;
+
+#ifdef HSHG_HASHED
+
+#define collide_at(from, x, y, z)                       \
+    hshg_collide_cell(hshg, entity, grid, (from), x _2D(, y) _3D(, z))
+
+#define collide_with(x, y, z)                           \
+    collide_at(hshg_cell_get(hshg, grid,                \
+        grid_get_idx(grid, x _2D(, y) _3D(, z))), x, y, z)
+
+    for(entity = hshg->entities + 1; entity != entity_max; ++entity)
+    {
+        if(invalid_entity(entity))
+        {
+            continue;
+        }
+
+        const _hshg_grid* grid = hshg->grids + entity->grid;
+
+        hshg_coord_t cell_x = grid_get_cell_1d(grid, 0, entity->x);
+    _2D(hshg_coord_t cell_y = grid_get_cell_1d(grid, 1, entity->y);)
+    _3D(hshg_coord_t cell_z = grid_get_cell_1d(grid, 2, entity->z);)
+
+        collide_at(entity->next, cell_x, cell_y, cell_z);
+
+        /*
+         * With only one cell, all neighbours are that cell too.
+         */
+        if(grid->cells_log != 0)
+        {
+        _3D(
+            for(hshg_coord_t y = cell_y - 1; y <= cell_y + 1; ++y)
+            {
+                for(hshg_coord_t x = cell_x - 1; x <= cell_x + 1; ++x)
+                {
+                    collide_with(x, y, cell_z - 1);
+                }
+            }
+        )
+            collide_with(cell_x + 1, cell_y, cell_z);
+        _2D(
+            for(hshg_coord_t x = cell_x - 1; x <= cell_x + 1; ++x)
+            {
+                collide_with(x, cell_y + 1, cell_z);
+            }
+        )
+        }
+
+        while(grid->shift)
+        {
+            cell_x >>= grid->shift;
+        _2D(cell_y >>= grid->shift;)
+        _3D(cell_z >>= grid->shift;)
+
+            grid += grid->shift;
+
+            if(grid->cells_log == 0)
+            {
+                collide_at(hshg_cell_get(hshg, grid, 0),
+                    cell_x, cell_y, cell_z);
+
+                continue;
+            }
+
+        _3D(for(hshg_coord_t z = cell_z - 1; z <= cell_z + 1; ++z))
+            {
+
+        _2D(for(hshg_coord_t y = cell_y - 1; y <= cell_y + 1; ++y))
+            {
+
+            for(hshg_coord_t x = cell_x - 1; x <= cell_x + 1; ++x)
+            {
+                collide_with(x, y, z);
+            }
+
+            }
+
+            }
+        }
+    }
+
+#undef collide_with
+#undef collide_at
+
+#else
+
+#ifdef HSHG_GHOST
+
+    _hshg_entity_t i;
+    const _hshg_entity* ent;
+
+    for(entity = hshg->entities + 1; entity != entity_max; ++entity)
+    {
+        if(invalid_entity(entity))
+        {
+            continue;
+        }
+
+        hshg_prefetch_cells(hshg, entity, entity_max);
+
+        const _hshg_grid* grid = hshg->grids + entity->grid;
+
+        loop_over(entity->next);
+
+        for(uint8_t k = HSHG_STENCIL_LEN / 2 + 1; k < HSHG_STENCIL_LEN; ++k)
+        {
+            loop_over(hshg_cell_get(hshg, grid,
+                entity->cell + grid->stencil[k]));
+        }
+
+        if(grid->shift == 0)
+        {
+            continue;
+        }
+
+        _hshg_cell_t cell_x = idx_get_x(grid, entity->cell);
+    _2D(_hshg_cell_t cell_y = idx_get_y(grid, entity->cell);)
+    _3D(_hshg_cell_t cell_z = idx_get_z(grid, entity->cell);)
+
+        do
+        {
+            cell_x >>= grid->shift;
+        _2D(cell_y >>= grid->shift;)
+        _3D(cell_z >>= grid->shift;)
+
+
+            grid += grid->shift;
+
+
+            const _hshg_cell_sq_t cell =
+                grid_get_idx(grid, cell_x _2D(, cell_y) _3D(, cell_z));
+
+            hshg_prefetch_up(grid, cell_x _2D(, cell_y) _3D(, cell_z));
+
+            for(uint8_t k = 0; k < HSHG_STENCIL_LEN; ++k)
+            {
+                loop_over(hshg_cell_get(hshg, grid, cell + grid->stencil[k]));
+            }
+        }
+        while(grid->shift);
+    }
+
+#else
+
+    for(entity = hshg->entities + 1; entity != entity_max; ++entity)
+    {
+        if(invalid_entity(entity))
+        {
+            continue;
+        }
+
+        hshg_prefetch_cells(hshg, entity, entity_max);
+
+#ifdef HSHG_STATIC_SIDE
+        /*
+         * Unrolled, so that every grid gets its own copy of the code with its
+         * sides, masks and shifts folded into constants.
+         */
+#pragma GCC unroll 32
+        for(uint8_t level = 0; level < HSHG_STATIC_GRIDS_LEN; ++level)
+        {
+            if(entity->grid == level)
+            {
+                hshg_collide_entity(hshg, entity, hshg->grids + level,
+                    hshg_static_grids + level);
+
+                break;
+            }
+        }
+#else
+        const _hshg_grid* const grid = hshg->grids + entity->grid;
+
+        hshg_collide_entity(hshg, entity, grid, grid);
+#endif /* HSHG_STATIC_SIDE */
+    }
+
+#endif /* HSHG_GHOST */
+
+#undef loop_over
+
+#endif /* HSHG_HASHED */
+
+    hshg_set(colliding, 0);
+}
+
+
+/*
+ * Returns the first occupied cell starting from the given one, or cells_len
+ * if there are none. Whole words of empty cells are skipped at once.
+ */
+static _hshg_cell_sq_t
+hshg_next_cell(const _hshg* const hshg, const _hshg_cell_sq_t cell)
+{
+    if(cell >= hshg->cells_len)
+    {
+        return hshg->cells_len;
+    }
+
+    const uint64_t* word = hshg->cells_used + (cell >> 6);
+    const uint64_t* const word_max =
+        hshg->cells_used + hshg_cells_used_len(hshg->cells_len);
+
+    uint64_t bits = *word & (UINT64_MAX << (cell & 63));
+
+    while(bits == 0)
+    {
+        ++word;
+
+        if(word == word_max)
+        {
+            return hshg->cells_len;
+        }
+
+        bits = *word;
+    }
+
+    return ((_hshg_cell_sq_t)(word - hshg->cells_used) << 6) |
+        __builtin_ctzll(bits);
+}
+
+
+/*
+ * Copies entities of cells from the given range to the new array, starting at
+ * the given index, relinking them along the way. Returns the next free index.
+ */
+static _hshg_entity_t
+hshg_optimize_cells(_hshg* const hshg, _hshg_entity* const entities,
+    const _hshg_cell_sq_t start, const _hshg_cell_sq_t end, _hshg_entity_t idx)
+{
+    for(_hshg_cell_sq_t i = hshg_next_cell(hshg, start);
+        i < end; i = hshg_next_cell(hshg, i + 1))
+    {
+        _hshg_entity_t entity_idx = hshg->cells[i];
+
+        hshg->cells[i] = idx;
+
+        while(1)
+        {
+            _hshg_entity* const entity = entities + idx;
+
+            *entity = hshg->entities[entity_idx];
+
+_HSHG_PREV(
+            if(entity->prev != 0)
+            {
+                entity->prev = idx - 1;
+            }
+)
+
+            ++idx;
+
+            if(entity->next != 0)
+            {
+                entity_idx = entity->next;
+                entity->next = idx;
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+
+    return idx;
+}
+
+
+#ifdef HSHG_CSR
+
+/*
+ * Entities of every cell are next to each other, so the range of an entity's
+ * cell ends right after the first entity from it on that's last in its list.
+ */
+static void
+hshg_csr_build(_hshg* const hshg)
+{
+    _hshg_entity_t end = 0;
+
+    for(_hshg_entity_t i = hshg->entities_used - 1; i != 0; --i)
+    {
+        if(hshg->entities[i].next == 0)
+        {
+            end = i + 1;
+        }
+
+        hshg->csr_ends[i] = end;
+    }
+
+    hshg->csr = 1;
+}
+
+#endif /* HSHG_CSR */
+
+
+static void
+hshg_optimize_finish(_hshg* const hshg, _hshg_entity* const entities,
+    const _hshg_entity_t idx)
+{
+    hshg_mem_free(&hshg->allocator, hshg->entities);
+
+    hshg->entities = entities;
+    hshg->entities_used = idx;
+    hshg->free_entity = 0;
+    hshg->optimize_cell = 0;
+    hshg->optimize_idx = 1;
+
+_HSHG_CSR(hshg_csr_build(hshg);)
+_HSHG_SLEEP(hshg_awake_build(hshg);)
 }
 
 
 int
-_hshg_insert(_hshg* const hshg, const _hshg_pos_t x _2D(, const _hshg_pos_t y)
-    _3D(, const _hshg_pos_t z), const _hshg_pos_t r, const _hshg_entity_t ref)
+_hshg_optimize(_hshg* const hshg)
 {
     assert(!hshg->calling &&
-        "hshg_insert() may not be called from any callback");
+        "hshg_optimize() may not be called from any callback");
 
-    const _hshg_entity_t idx = hshg_get_entity(hshg);
+    _hshg_entity* const entities = hshg_mem_malloc(&hshg->allocator,
+        sizeof(_hshg_entity) * hshg->entities_size, HSHG_CACHE_LINE);
 
-    if(idx == 0)
+    if(entities == NULL)
     {
         return -1;
     }
 
-    _hshg_entity* const ent = hshg->entities + idx;
-
-    ent->grid = hshg_get_grid(hshg, r);
-    ent->ref = ref;
-    ent->x = x;
-_2D(ent->y = y;)
-_3D(ent->z = z;)
-    ent->r = r;
+    const _hshg_entity_t idx =
+        hshg_optimize_cells(hshg, entities, 0, hshg->cells_len, 1);
 
-    hshg_reinsert(hshg, idx);
+    hshg_optimize_finish(hshg, entities, idx);
 
     return 0;
 }
 
 
-static void
-hshg_remove_light(_hshg* const hshg)
+int
+_hshg_optimize_multithread(_hshg* const hshg,
+    const uint8_t threads, const uint8_t idx)
 {
-    _hshg_entity* const entity = hshg->entities + hshg->entity_id;
-    _hshg_grid* const grid = hshg->grids + entity->grid;
+    assert(hshg->barrier);
+    assert(!hshg->calling &&
+        "hshg_optimize_multithread() may not be called from any callback");
 
-    if(entity->prev == 0)
+    if(idx == 0)
     {
-        grid->cells[entity->cell] = entity->next;
+        hshg->optimize_entities = hshg_mem_malloc(&hshg->allocator,
+            sizeof(_hshg_entity) * hshg->entities_size, HSHG_CACHE_LINE);
+        hshg->optimize_counts = hshg_mem_malloc(&hshg->allocator,
+            sizeof(_hshg_entity_t) * threads, hshg_align);
+
+        if(hshg->optimize_entities == NULL || hshg->optimize_counts == NULL)
+        {
+            hshg_mem_free(&hshg->allocator, hshg->optimize_entities);
+            hshg_mem_free(&hshg->allocator, hshg->optimize_counts);
+
+            hshg->optimize_entities = NULL;
+        }
     }
-    else
+
+    hshg->barrier(hshg);
+
+    _hshg_entity* const entities = hshg->optimize_entities;
+
+    if(entities == NULL)
     {
-        hshg->entities[entity->prev].next = entity->next;
+        return -1;
     }
 
-    hshg->entities[entity->next].prev = entity->prev;
+    /*
+     * Cells are split on word boundaries of the occupancy bitmap, so that
+     * every thread's range is exactly as fast to scan.
+     */
+    const uint64_t words = hshg_cells_used_len(hshg->cells_len);
+    const _hshg_cell_sq_t start = (words * idx / threads) << 6;
+    const _hshg_cell_sq_t end =
+        min((words * (idx + 1) / threads) << 6, (uint64_t) hshg->cells_len);
 
-    --grid->entities_len;
+    _hshg_entity_t count = 0;
 
-    if(grid->entities_len == 0)
+    for(_hshg_cell_sq_t i = hshg_next_cell(hshg, start);
+        i < end; i = hshg_next_cell(hshg, i + 1))
     {
-        hshg->new_cache ^= UINT32_C(1) << entity->grid;
+        for(_hshg_entity_t j = hshg->cells[i]; j != 0;
+            j = hshg->entities[j].next)
+        {
+            ++count;
+        }
     }
-}
 
+    hshg->optimize_counts[idx] = count;
 
-void
-_hshg_remove(_hshg* const hshg)
-{
-    assert(hshg->updating &&
-        "hshg_remove() may only be called from within hshg.update()");
+    hshg->barrier(hshg);
 
-    hshg_set(removed, 1);
+    _hshg_entity_t offset = 1;
 
-    hshg_remove_light(hshg);
-    hshg_return_entity(hshg);
-}
+    for(uint8_t i = 0; i < idx; ++i)
+    {
+        offset += hshg->optimize_counts[i];
+    }
 
+    (void) hshg_optimize_cells(hshg, entities, start, end, offset);
 
-void
-_hshg_move(_hshg* const hshg)
-{
-    assert(hshg->updating &&
-        "hshg_move() may only be called from within hshg.update()");
+    hshg->barrier(hshg);
 
-    const _hshg_entity_t idx = hshg->entity_id;
-    _hshg_entity* const entity = hshg->entities + idx;
-    const _hshg_grid* const grid = hshg->grids + entity->grid;
+    if(idx == 0)
+    {
+        _hshg_entity_t used = 1;
 
-    const _hshg_cell_sq_t new_cell =
-        grid_get_cell(grid, entity->x _2D(, entity->y) _3D(, entity->z));
+        for(uint8_t i = 0; i < threads; ++i)
+        {
+            used += hshg->optimize_counts[i];
+        }
 
-    if(entity->cell != new_cell)
-    {
-        hshg_remove_light(hshg);
-        hshg_reinsert(hshg, idx);
+        hshg_mem_free(&hshg->allocator, hshg->optimize_counts);
+
+        hshg_optimize_finish(hshg, entities, used);
+
+        hshg->optimize_entities = NULL;
     }
+
+    hshg->barrier(hshg);
+
+    return 0;
 }
 
 
-void
-_hshg_resize(_hshg* const hshg)
+/*
+ * Slot of hshg.cells of the cell the entity is in. With HSHG_SPARSE, its key
+ * is inserted into the table if it isn't there yet.
+ */
+static _hshg_cell_sq_t
+hshg_entity_slot(_hshg* const hshg, const _hshg_entity* const entity)
 {
-    assert(hshg->updating &&
-        "hshg_resize() may only be called from within hshg.update()");
+    return hshg_cell_ptr(hshg, hshg->grids + entity->grid, entity->cell)
+        - hshg->cells;
+}
 
-    const _hshg_entity_t idx = hshg->entity_id;
-    _hshg_entity* const entity = hshg->entities + idx;
-    const uint8_t new_grid = hshg_get_grid(hshg, entity->r);
 
-    if(entity->grid != new_grid)
-    {
-        hshg_remove_light(hshg);
+static int
+hshg_same_cell(const _hshg_entity* const a, const _hshg_entity* const b)
+{
+    return a->grid == b->grid && a->cell == b->cell;
+}
 
-        entity->grid = new_grid;
 
-        hshg_reinsert(hshg, idx);
-    }
+static void
+hshg_no_barrier(const _hshg* const hshg)
+{
+    (void) hshg;
 }
 
 
-void
-_hshg_update(_hshg* const hshg)
+/*
+ * A counting sort of entities by the slot of their cell, using hshg.cells
+ * itself for the counts. Every thread sorts its own range of cells, which
+ * costs every thread a read of all entities, but writes only what it owns.
+ * With HSHG_SPARSE, the table is filled as entities are counted, so the
+ * first thread does all of it.
+ */
+static int
+hshg_rebuild_common(_hshg* const hshg, const uint8_t threads,
+    const uint8_t idx, const _hshg_barrier_t barrier)
 {
-    assert(hshg->update);
-    assert(!hshg->calling &&
-        "hshg_update() may not be called from any callback");
+    /*
+     * Every thread has a row of counts, the first of which is the number of
+     * entities in its range of cells, and the rest are numbers of entities
+     * of every grid among the entities it updated.
+     */
+    const uint8_t row_len = hshg->grids_len + 1;
 
-    hshg_set(updating, 1);
+    if(idx == 0)
+    {
+        hshg->optimize_entities = hshg_mem_malloc(&hshg->allocator,
+            sizeof(_hshg_entity) * hshg->entities_size, HSHG_CACHE_LINE);
+        hshg->optimize_counts = hshg_mem_calloc(&hshg->allocator,
+            sizeof(_hshg_entity_t) * threads * row_len, hshg_align);
 
-    _hshg_entity* entity = hshg->entities;
+        if(hshg->optimize_entities == NULL || hshg->optimize_counts == NULL)
+        {
+            hshg_mem_free(&hshg->allocator, hshg->optimize_entities);
+            hshg_mem_free(&hshg->allocator, hshg->optimize_counts);
 
-#define i hshg->entity_id
+            hshg->optimize_entities = NULL;
+        }
+    }
 
-    for(i = 1; i < hshg->entities_used; ++i)
+    barrier(hshg);
+
+    _hshg_entity* const entities = hshg->optimize_entities;
+
+    if(entities == NULL)
     {
-        ++entity;
+        return -1;
+    }
+
+    const _hshg_entity_t used = hshg->entities_used;
+    const _hshg_entity_t first = hshg_update_start(used, threads, idx);
+    const _hshg_entity_t last = idx + 1 == threads ? used :
+        hshg_update_start(used, threads, idx + 1);
+
+#ifdef HSHG_SPARSE
+    const _hshg_cell_sq_t start = 0;
+    const _hshg_cell_sq_t end = idx == 0 ? hshg->cells_len : 0;
+#else
+    const uint64_t words = hshg_cells_used_len(hshg->cells_len);
+    const _hshg_cell_sq_t start = (words * idx / threads) << 6;
+    const _hshg_cell_sq_t end =
+        min((words * (idx + 1) / threads) << 6, (uint64_t) hshg->cells_len);
+#endif
+
+    _hshg_entity_t* const counts = hshg->optimize_counts + idx * row_len;
+
+    for(_hshg_entity_t i = first; i < last; ++i)
+    {
+        _hshg_entity* const entity = hshg->entities + i;
 
         if(invalid_entity(entity))
         {
             continue;
         }
 
-        hshg->update(hshg, entity);
-    }
+        entity->grid = hshg_get_grid(hshg, entity->r);
+        entity->cell = grid_get_cell(hshg->grids + entity->grid,
+            entity->x _2D(, entity->y) _3D(, entity->z));
 
-#undef i
+        ++counts[1 + entity->grid];
+    }
 
-    hshg_set(removed, 0);
-    hshg_set(updating, 0);
-}
+    (void) memset(hshg->cells + start, 0,
+        sizeof(_hshg_entity_t) * (end - start));
+    (void) memset(hshg->cells_used + (start >> 6), 0,
+        sizeof(uint64_t) * (hshg_cells_used_len(end) - (start >> 6)));
 
+    barrier(hshg);
 
-void
-_hshg_update_multithread(const _hshg* const hshg,
-    const uint8_t threads, const uint8_t idx)
-{
-    assert(hshg->const_update);
+    if(start != end)
+    {
+        for(_hshg_entity_t i = 1; i < used; ++i)
+        {
+            const _hshg_entity* const entity = hshg->entities + i;
 
-    const _hshg_entity_t used = hshg->entities_used - 1;
-    const _hshg_entity_t div = used / threads;
-    const _hshg_entity_t start = div * idx + 1;
-    const _hshg_entity_t end =
-        div + (idx + 1 == threads ? (used % threads) : 0) + 1;
+            if(invalid_entity(entity))
+            {
+                continue;
+            }
 
-    _hshg_entity* entity;
-    _hshg_entity* const entity_max = hshg->entities + end;
+            const _hshg_cell_sq_t slot = hshg_entity_slot(hshg, entity);
 
-    for(entity = hshg->entities + start; entity != entity_max; ++entity)
-    {
-        if(invalid_entity(entity))
-        {
-            continue;
+            if(slot >= start && slot < end)
+            {
+                ++hshg->cells[slot];
+                ++counts[0];
+            }
         }
+    }
 
-        hshg->const_update(hshg, entity);
+    barrier(hshg);
+
+    _hshg_entity_t offset = 1;
+
+    for(uint8_t t = 0; t < idx; ++t)
+    {
+        offset += hshg->optimize_counts[t * row_len];
     }
-}
 
+    /*
+     * Counts turn into where cells end in the new array, and entities are put
+     * in front of that from the last one, so that cells end up pointing to
+     * where they start, with entities in the same order as before.
+     */
+    _hshg_entity_t end_idx = offset;
 
-void
-_hshg_update_cache(_hshg* const hshg)
-{
-    if(hshg->old_cache == hshg->new_cache)
+    for(_hshg_cell_sq_t slot = start; slot < end; ++slot)
     {
-        return;
+        if(hshg->cells[slot] != 0)
+        {
+            end_idx += hshg->cells[slot];
+            hshg->cells[slot] = end_idx;
+            hshg_cell_set_used(hshg, slot);
+        }
     }
 
-    hshg->old_cache = hshg->new_cache;
+    if(start != end)
+    {
+        for(_hshg_entity_t i = used - 1; i != 0; --i)
+        {
+            const _hshg_entity* const entity = hshg->entities + i;
 
-    _hshg_grid* old_grid;
-    const _hshg_grid* const grid_max = hshg->grids + hshg->grids_len;
+            if(invalid_entity(entity))
+            {
+                continue;
+            }
 
-    for(old_grid = hshg->grids; old_grid != grid_max; ++old_grid)
+            const _hshg_cell_sq_t slot = hshg_entity_slot(hshg, entity);
+
+            if(slot >= start && slot < end)
+            {
+                entities[--hshg->cells[slot]] = *entity;
+            }
+        }
+    }
+
+    for(_hshg_entity_t i = offset; i < end_idx; ++i)
     {
-        old_grid->shift = 0;
+        _hshg_entity* const entity = entities + i;
+
+        entity->next = i + 1 != end_idx &&
+            hshg_same_cell(entity, entity + 1) ? i + 1 : 0;
+    _HSHG_PREV(entity->prev = i != offset &&
+            hshg_same_cell(entity, entity - 1) ? i - 1 : 0;)
     }
 
-    old_grid = hshg->grids;
+    barrier(hshg);
 
-    while(1)
+    if(idx == 0)
     {
-        if(old_grid == grid_max)
+        _hshg_entity_t new_used = 1;
+
+        for(uint8_t g = 0; g < hshg->grids_len; ++g)
         {
-            return;
+            hshg->grids[g].entities_len = 0;
+        }
+
+        for(uint8_t t = 0; t < threads; ++t)
+        {
+            new_used += hshg->optimize_counts[t * row_len];
+
+            for(uint8_t g = 0; g < hshg->grids_len; ++g)
+            {
+                hshg->grids[g].entities_len +=
+                    hshg->optimize_counts[t * row_len + 1 + g];
+            }
         }
 
-        if(old_grid->entities_len != 0)
-        {
-            break;
-        }
+        hshg_mem_free(&hshg->allocator, hshg->optimize_counts);
+
+        hshg_recache(hshg);
+        hshg_optimize_finish(hshg, entities, new_used);
+
+        hshg->optimize_entities = NULL;
+    }
+
+    barrier(hshg);
+
+    return 0;
+}
+
+
+int
+_hshg_rebuild(_hshg* const hshg)
+{
+    assert(!hshg->calling &&
+        "hshg_rebuild() may not be called from any callback");
+
+    return hshg_rebuild_common(hshg, 1, 0, hshg_no_barrier);
+}
+
+
+int
+_hshg_rebuild_multithread(_hshg* const hshg,
+    const uint8_t threads, const uint8_t idx)
+{
+    assert(hshg->barrier);
+    assert(!hshg->calling &&
+        "hshg_rebuild_multithread() may not be called from any callback");
+
+    return hshg_rebuild_common(hshg, threads, idx, hshg->barrier);
+}
+
+
+_hshg*
+_hshg_regrid(_hshg* const hshg, const _hshg_cell_t side, const uint32_t size)
+{
+    return _hshg_regrid_rect(hshg, side _2D(, side) _3D(, side), size);
+}
+
+
+_hshg*
+_hshg_regrid_rect(_hshg* const hshg, const _hshg_cell_t side_x
+    _2D(, const _hshg_cell_t side_y) _3D(, const _hshg_cell_t side_z),
+    const uint32_t size)
+{
+    assert(!hshg->calling &&
+        "hshg_regrid() may not be called from any callback");
+
+    _hshg* const new_hshg = _hshg_create_rect_alloc(side_x _2D(, side_y)
+        _3D(, side_z), size, &hshg->allocator);
 
-        ++old_grid;
+    if(new_hshg == NULL)
+    {
+        return NULL;
     }
 
-    _hshg_grid* new_grid;
+#ifdef HSHG_SPARSE
+    const _hshg_cell_sq_t cells_len = hshg_cells_table_len(hshg->entities_size);
 
-    uint8_t shift = 1;
+    if(cells_len > new_hshg->cells_len &&
+        hshg_cells_resize(new_hshg, cells_len) == -1)
+    {
+        _hshg_free(new_hshg);
 
-    for(new_grid = old_grid + 1; new_grid != grid_max; ++new_grid)
+        return NULL;
+    }
+#endif
+
+    new_hshg->entities = hshg->entities;
+
+    new_hshg->update = hshg->update;
+    new_hshg->const_update = hshg->const_update;
+    new_hshg->collide = hshg->collide;
+    new_hshg->query = hshg->query;
+    new_hshg->barrier = hshg->barrier;
+
+    new_hshg->free_entity = hshg->free_entity;
+    new_hshg->entities_used = hshg->entities_used;
+    new_hshg->entities_size = hshg->entities_size;
+
+_HSHG_CSR(new_hshg->csr_ends = hshg->csr_ends;)
+_HSHG_SLEEP(new_hshg->awake = hshg->awake;)
+    new_hshg->update_commands = hshg->update_commands;
+    new_hshg->update_removed = hshg->update_removed;
+
+    hshg_mem_free(&hshg->allocator, hshg->cells);
+_HSHG_SPARSE(hshg_mem_free(&hshg->allocator, hshg->keys);)
+    hshg_mem_free(&hshg->allocator, hshg->cells_used);
+    hshg_mem_free(&hshg->allocator, hshg->update_counts);
+    hshg_mem_free(&hshg->allocator, hshg);
+
+    /*
+     * Going from the back makes every cell list entities in the order of the
+     * array, since each one is put in front of the ones after it.
+     */
+    for(_hshg_entity_t i = new_hshg->entities_used - 1; i != 0; --i)
     {
-        if(new_grid->entities_len == 0)
-        {
-            ++shift;
+        _hshg_entity* const entity = new_hshg->entities + i;
 
+        if(invalid_entity(entity))
+        {
             continue;
         }
 
-        old_grid->shift = shift;
-        old_grid = new_grid;
-        shift = 1;
+        entity->grid = hshg_get_grid(new_hshg, entity->r);
+
+        hshg_reinsert(new_hshg, i);
     }
+
+    return new_hshg;
 }
 
 
 void
-_hshg_collide(_hshg* const hshg)
+_hshg_optimize_inplace(_hshg* const hshg)
 {
-    assert(hshg->collide);
     assert(!hshg->calling &&
-        "hshg_collide() may not be called from any callback");
+        "hshg_optimize_inplace() may not be called from any callback");
 
-    hshg_set(colliding, 1);
-
-    _hshg_update_cache(hshg);
+    _hshg_entity* const entities = hshg->entities;
 
-    const _hshg_entity* entity;
-    const _hshg_entity* const entity_max =
-        hshg->entities + hshg->entities_used;
+    _hshg_entity_t idx = 1;
 
-    _hshg_entity_t i;
-    const _hshg_entity* ent;
+    /*
+     * Number entities in the same order as hshg_optimize() would. The new
+     * index is kept in next, because the links are rebuilt from scratch later.
+     */
+    for(_hshg_cell_sq_t i = hshg_next_cell(hshg, 0);
+        i != hshg->cells_len; i = hshg_next_cell(hshg, i + 1))
+    {
+        _hshg_entity_t entity_idx = hshg->cells[i];
 
-#define loop_over(from)                     \
-                                            \
-do                                          \
-{                                           \
-    i = (from);                             \
-                                            \
-    while(i != 0)                           \
-    {                                       \
-        ent = hshg->entities + i;           \
-                                            \
-        hshg->collide(hshg, entity, ent);   \
-                                            \
-        i = ent->next;                      \
-    }                                       \
-}                                           \
-while(0)
+        hshg->cells[i] = idx;
 
-    for(entity = hshg->entities + 1; entity != entity_max; ++entity)
-    {
-        if(invalid_entity(entity))
+        do
         {
-            continue;
+            _hshg_entity* const entity = entities + entity_idx;
+
+            entity_idx = entity->next;
+
+            entity->next = idx;
+            ++idx;
         }
+        while(entity_idx != 0);
+    }
 
-        const _hshg_grid* grid = hshg->grids + entity->grid;
+    /*
+     * Follow cycles of the permutation, putting one entity in its final place
+     * per swap. Holes are pushed wherever there's space, which is always past
+     * the last valid entity by the time this loop finishes.
+     */
+    for(_hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        _hshg_entity* const entity = entities + i;
 
-        _hshg_cell_t cell_x = idx_get_x(grid, entity->cell);
-    _2D(_hshg_cell_t cell_y = idx_get_y(grid, entity->cell);)
-    _3D(_hshg_cell_t cell_z = idx_get_z(grid, entity->cell);)
-_3D(
-        if(cell_z != 0)
+        while(!invalid_entity(entity) && entity->next != i)
         {
+            _hshg_entity* const dest = entities + entity->next;
+            const _hshg_entity temp = *dest;
 
-            if(cell_y != 0)
-            {
-                const _hshg_entity_t* const cell = grid->cells +
-                    (entity->cell - grid->cells_sq - grid->cells_side);
-
-                if(cell_x != 0)
-                {
-                    loop_over(*(cell - 1));
-                }
+            *dest = *entity;
+            *entity = temp;
+        }
+    }
 
-                loop_over(*cell);
+    /*
+     * Every cell's entities are now adjacent, and no two adjacent cells are the
+     * same, so a cell ends where the next entity is in a different one.
+     */
+    uint8_t head = 1;
 
-                if(cell_x != grid->cells_mask)
-                {
-                    loop_over(*(cell + 1));
-                }
-            }
+    for(_hshg_entity_t i = 1; i < idx; ++i)
+    {
+        _hshg_entity* const entity = entities + i;
+        const _hshg_entity* const next = entity + 1;
 
-            {
-                const _hshg_entity_t* const cell =
-                    grid->cells + (entity->cell - grid->cells_sq);
+    _HSHG_PREV(entity->prev = head ? 0 : i - 1;)
+        head = i + 1 == idx ||
+            next->cell != entity->cell || next->grid != entity->grid;
+        entity->next = head ? 0 : i + 1;
+    }
 
-                if(cell_x != 0)
-                {
-                    loop_over(*(cell - 1));
-                }
+    hshg->entities_used = idx;
+    hshg->free_entity = 0;
+    hshg->optimize_cell = 0;
+    hshg->optimize_idx = 1;
 
-                loop_over(*cell);
+_HSHG_CSR(hshg_csr_build(hshg);)
+_HSHG_SLEEP(hshg_awake_build(hshg);)
+}
 
-                if(cell_x != grid->cells_mask)
-                {
-                    loop_over(*(cell + 1));
-                }
-            }
 
-            if(cell_y != grid->cells_mask)
-            {
-                const _hshg_entity_t* const cell = grid->cells +
-                    (entity->cell - grid->cells_sq + grid->cells_side);
+int
+_hshg_optimize_incremental(_hshg* const hshg,
+    _hshg_cell_sq_t cells, _hshg_entity_t entities)
+{
+    assert(!hshg->calling &&
+        "hshg_optimize_incremental() may not be called from any callback");
 
-                if(cell_x != 0)
-                {
-                    loop_over(*(cell - 1));
-                }
+_HSHG_CSR(hshg->csr = 0;)
 
-                loop_over(*cell);
+    _hshg_cell_sq_t i = hshg_next_cell(hshg, hshg->optimize_cell);
+    _hshg_entity_t idx = hshg->optimize_idx;
 
-                if(cell_x != grid->cells_mask)
-                {
-                    loop_over(*(cell + 1));
-                }
-            }
-        }
-)
-        loop_over(entity->next);
+    for(; i != hshg->cells_len && cells != 0 && entities != 0;
+        i = hshg_next_cell(hshg, i + 1), --cells)
+    {
+        _hshg_entity_t entity_idx = hshg->cells[i];
 
-        if(cell_x != grid->cells_mask)
-        {
-            loop_over(grid->cells[entity->cell + 1]);
-        }
-_2D(
-        if(cell_y != grid->cells_mask)
+        while(entity_idx != 0)
         {
-            const _hshg_entity_t* const cell =
-                grid->cells + (entity->cell + grid->cells_side);
-
-            if(cell_x != 0)
+            /*
+             * Entities below idx were already placed during this pass, but
+             * moved to a later cell since then. Leave them be, so that the
+             * already sorted part of the array only ever contains entities.
+             */
+            if(entity_idx < idx)
             {
-                loop_over(*(cell - 1));
+                entity_idx = hshg->entities[entity_idx].next;
+
+                continue;
             }
 
-            loop_over(*cell);
+            hshg_swap_entities(hshg, entity_idx, idx);
 
-            if(cell_x != grid->cells_mask)
+            entity_idx = hshg->entities[idx].next;
+            ++idx;
+
+            if(entities != 0)
             {
-                loop_over(*(cell + 1));
+                --entities;
             }
         }
-)
-        while(grid->shift)
-        {
-            cell_x >>= grid->shift;
-        _2D(cell_y >>= grid->shift;)
-        _3D(cell_z >>= grid->shift;)
+    }
 
+    if(i != hshg->cells_len)
+    {
+        hshg->optimize_cell = i;
+        hshg->optimize_idx = idx;
 
-            grid += grid->shift;
+        return 0;
+    }
 
+    /*
+     * Entities inserted or moved during the pass may still sit past the sorted
+     * part, and ones removed from it leave holes in it, so only the holes at
+     * the end are trimmed and the list of free entities is made from the rest.
+     */
+    _hshg_entity_t used = hshg->entities_used;
 
-            const _hshg_cell_t min_cell_x =
-                cell_x != 0 ? cell_x - 1 : 0;
+    while(used > 1 && invalid_entity(hshg->entities + used - 1))
+    {
+        --used;
+    }
 
-        _2D(const _hshg_cell_t min_cell_y =
-                cell_y != 0 ? cell_y - 1 : 0;)
+    hshg->entities_used = used;
+    hshg->free_entity = 0;
 
-        _3D(const _hshg_cell_t min_cell_z =
-                cell_z != 0 ? cell_z - 1 : 0;)
+    for(_hshg_entity_t j = used - 1; j != 0; --j)
+    {
+        _hshg_entity* const entity = hshg->entities + j;
 
+        if(!invalid_entity(entity))
+        {
+            continue;
+        }
 
-            const _hshg_cell_t max_cell_x =
-                cell_x != grid->cells_mask ? cell_x + 1 : cell_x;
+        entity->next = hshg->free_entity;
+    _HSHG_PREV(
+        entity->prev = 0;
+        hshg->entities[hshg->free_entity].prev = j;
+    )
+        hshg->free_entity = j;
+    }
 
-        _2D(const _hshg_cell_t max_cell_y =
-                cell_y != grid->cells_mask ? cell_y + 1 : cell_y;)
+    hshg->optimize_cell = 0;
+    hshg->optimize_idx = 1;
 
-        _3D(const _hshg_cell_t max_cell_z =
-                cell_z != grid->cells_mask ? cell_z + 1 : cell_z;)
+    return 1;
+}
 
 
-             _hshg_cell_t cur_x;
-        _2D(_hshg_cell_t cur_y;)
-        _3D(_hshg_cell_t cur_z;)
+_hshg_entity_t
+_hshg_compact(_hshg* const hshg, _hshg_entity_t* const moved)
+{
+    assert(!hshg->calling &&
+        "hshg_compact() may not be called from any callback");
 
-        _3D(for(cur_z = min_cell_z; cur_z <= max_cell_z; ++cur_z))
-            {
+    _hshg_entity_t moved_len = 0;
+    _hshg_entity_t hole = 1;
+    _hshg_entity_t last = hshg->entities_used - 1;
 
-        _2D(for(cur_y = min_cell_y; cur_y <= max_cell_y; ++cur_y))
-            {
+    while(1)
+    {
+        while(hole < last && !invalid_entity(hshg->entities + hole))
+        {
+            ++hole;
+        }
 
-            for(cur_x = min_cell_x; cur_x <= max_cell_x; ++cur_x)
-            {
-                const _hshg_cell_t cell =
-                    grid_get_idx(grid, cur_x _2D(, cur_y) _3D(, cur_z));
+        while(last > hole && invalid_entity(hshg->entities + last))
+        {
+            --last;
+        }
 
-                loop_over(grid->cells[cell]);
-            }
+        if(hole >= last)
+        {
+            break;
+        }
 
-            }
+        hshg_move_entity(hshg, last, hole);
 
-            }
+        if(moved != NULL)
+        {
+            moved[moved_len * 2] = last;
+            moved[moved_len * 2 + 1] = hole;
         }
+
+        ++moved_len;
+        ++hole;
+        --last;
     }
 
-#undef loop_over
+    _hshg_entity_t used = hshg->entities_used;
 
-    hshg_set(colliding, 0);
+    while(used > 1 && invalid_entity(hshg->entities + used - 1))
+    {
+        --used;
+    }
+
+    /*
+     * All holes are past the end of the array now, so there's nothing left to
+     * be freed. Moved entities also mess up the order that an unfinished pass
+     * of hshg_optimize_incremental() relies on, so it starts over.
+     */
+    hshg->entities_used = used;
+    hshg->free_entity = 0;
+    hshg->optimize_cell = 0;
+    hshg->optimize_idx = 1;
+
+_HSHG_CSR(hshg->csr = 0;)
+
+    return moved_len;
 }
 
 
-int
-_hshg_optimize(_hshg* const hshg)
+/*
+ * Whether the box of the entity touches the range. Integer positions are
+ * widened first, since boxes may reach past the range of hshg_pos_t.
+ */
+hshg_attrib_always_inline
+static inline int
+hshg_entity_in_range(const _hshg_entity* const entity
+    , const _hshg_pos_t x1
+_2D(, const _hshg_pos_t y1)
+_3D(, const _hshg_pos_t z1)
+    , const _hshg_pos_t x2
+_2D(, const _hshg_pos_t y2)
+_3D(, const _hshg_pos_t z2)
+)
 {
-    assert(!hshg->calling &&
-        "hshg_optimize() may not be called from any callback");
+#ifdef HSHG_INTEGER
+    const int64_t r = entity->r;
+#else
+    const _hshg_pos_t r = entity->r;
+#endif
 
-    _hshg_entity* const entities =
-        malloc(sizeof(_hshg_entity) * hshg->entities_size);
+    return
+        entity->x + r >= x1 &&
+        entity->x - r <= x2 _2D(&&
+        entity->y + r >= y1 &&
+        entity->y - r <= y2) _3D(&&
+        entity->z + r >= z1 &&
+        entity->z - r <= z2);
+}
 
-    if(entities == NULL)
-    {
-        return -1;
-    }
 
-    _hshg_entity_t idx = 1;
-    _hshg_entity_t* cell = hshg->cells;
+#ifdef HSHG_HASHED
+
+static void
+hshg_query_common(const _hshg* const hshg
+    , const _hshg_pos_t x1
+_2D(, const _hshg_pos_t y1)
+_3D(, const _hshg_pos_t z1)
+    , const _hshg_pos_t x2
+_2D(, const _hshg_pos_t y2)
+_3D(, const _hshg_pos_t z2)
+)
+{
+    assert(hshg->query);
+
+    assert(x1 <= x2);
+_2D(assert(y1 <= y2);)
+_3D(assert(z1 <= z2);)
+
+#define query_over(from, filter)                \
+                                                \
+do                                              \
+{                                               \
+    _hshg_entity_t j = (from);                  \
+    const _hshg_entity_t end =                  \
+        hshg_csr_end(hshg, j);                  \
+                                                \
+    while(j != 0)                               \
+    {                                           \
+        const _hshg_entity* const entity =      \
+            hshg->entities + j;                 \
+                                                \
+        hshg_prefetch_next(hshg,                \
+            entity, j, end);                    \
+                                                \
+        if((filter) && hshg_entity_in_range(    \
+            entity, x1 _2D(, y1) _3D(, z1),     \
+            x2 _2D(, y2) _3D(, z2)))            \
+        {                                       \
+            hshg->query(hshg, entity);          \
+        }                                       \
+                                                \
+        j = hshg_csr_next(entity, j, end);      \
+    }                                           \
+}                                               \
+while(0)
 
-    for(_hshg_cell_sq_t i = 0; i < hshg->cells_len; ++i)
+    const _hshg_grid* grid = hshg->grids;
+    const _hshg_grid* const grid_max = hshg->grids + hshg->grids_len;
+
+    for(; grid != grid_max; ++grid)
     {
-        _hshg_entity_t entity_idx = *cell;
+        if(grid->entities_len == 0)
+        {
+            continue;
+        }
 
-        if(entity_idx == 0)
+        const hshg_coord_t s_x = grid_get_cell_1d(grid, 0, x1) - 1;
+    _2D(const hshg_coord_t s_y = grid_get_cell_1d(grid, 1, y1) - 1;)
+    _3D(const hshg_coord_t s_z = grid_get_cell_1d(grid, 2, z1) - 1;)
+
+        const hshg_coord_t e_x = grid_get_cell_1d(grid, 0, x2) + 1;
+    _2D(const hshg_coord_t e_y = grid_get_cell_1d(grid, 1, y2) + 1;)
+    _3D(const hshg_coord_t e_z = grid_get_cell_1d(grid, 2, z2) + 1;)
+
+        const _hshg_cell_sq_t cells = (_hshg_cell_sq_t) 1 << grid->cells_log;
+
+        /*
+         * If there are at least as many cells in the range as there are in
+         * the grid, some of them would be visited many times, so instead go
+         * through all of them once. That's also how the biggest grid goes.
+         */
+        if(
+                (double)(e_x - s_x + 1)
+            _2D(* (double)(e_y - s_y + 1))
+            _3D(* (double)(e_z - s_z + 1))
+            >= cells
+        )
         {
-            ++cell;
+            for(_hshg_cell_sq_t cell = 0; cell < cells; ++cell)
+            {
+                query_over(hshg_cell_get(hshg, grid, cell), 1);
+            }
+
             continue;
         }
 
-        *cell = idx;
-        ++cell;
+    _3D(for(hshg_coord_t z = s_z; z <= e_z; ++z))
+        {
 
-        while(1)
+    _2D(for(hshg_coord_t y = s_y; y <= e_y; ++y))
         {
-            _hshg_entity* const entity = entities + idx;
 
-            *entity = hshg->entities[entity_idx];
+        for(hshg_coord_t x = s_x; x <= e_x; ++x)
+        {
+            const _hshg_cell_sq_t cell =
+                grid_get_idx(grid, x _2D(, y) _3D(, z));
 
-            if(entity->prev != 0)
-            {
-                entity->prev = idx - 1;
-            }
+            query_over(hshg_cell_get(hshg, grid, cell),
+                grid_get_cell_1d(grid, 0, entity->x) == x _2D(&&
+                grid_get_cell_1d(grid, 1, entity->y) == y) _3D(&&
+                grid_get_cell_1d(grid, 2, entity->z) == z));
+        }
 
-            ++idx;
+        }
 
-            if(entity->next != 0)
-            {
-                entity_idx = entity->next;
-                entity->next = idx;
-            }
-            else
-            {
-                break;
-            }
         }
     }
 
-    free(hshg->entities);
-
-    hshg->entities = entities;
-    hshg->entities_used = idx;
-    hshg->free_entity = 0;
-
-    return 0;
+#undef query_over
 }
 
+#else
 
 static void
-hshg_map_pos(const _hshg* const hshg, _hshg_cell_t* const ret,
-    const _hshg_pos_t _x1, const _hshg_pos_t _x2)
+hshg_map_pos(const _hshg* const hshg, const uint8_t axis,
+    _hshg_cell_t* const ret, const _hshg_pos_t _x1, const _hshg_pos_t _x2)
 {
-    _hshg_pos_t x1;
-    _hshg_pos_t x2;
+#ifdef HSHG_BOUNDED
+    const _hshg_grid* const grid = hshg->grids;
+
+    *(ret + 0) = grid_get_cell_1d(grid, axis, _x1);
+    *(ret + 1) = grid_get_cell_1d(grid, axis, _x2);
+#else
+    hshg_abs_pos_t x1;
+    hshg_abs_pos_t x2;
+
+#ifdef HSHG_INTEGER
+    /*
+     * The grid repeats every 2 * grid_size, so x1 can be reduced modulo that,
+     * which masking does exactly even for negative numbers.
+     */
+    const uint8_t grid_log = hshg->grid_log[axis];
+
+    x1 = (hshg_abs_pos_t) _x1 & ((UINT64_C(2) << grid_log) - 1);
+    x2 = x1 + ((hshg_abs_pos_t) _x2 - (hshg_abs_pos_t) _x1);
+
+    const uint64_t folds = (x2 >> grid_log) - (x1 >> grid_log);
+#else
+    const _hshg_cell_sq_t grid_size = hshg->grid_size[axis];
+    const _hshg_pos_t inverse_grid_size = hshg->inverse_grid_size[axis];
 
     if(_x1 < 0)
     {
         const _hshg_pos_t shift =
             ((
-                (_hshg_cell_t)(-_x1 * hshg->inverse_grid_size) << 1
-            ) + 2) * hshg->grid_size;
+                (int64_t)(-_x1 * inverse_grid_size) << 1
+            ) + 2) * grid_size;
 
         x1 = _x1 + shift;
         x2 = _x2 + shift;
@@ -925,20 +4521,24 @@ hshg_map_pos(const _hshg* const hshg, _hshg_cell_t* const ret,
         x2 = _x2;
     }
 
+    const int64_t folds =
+        (x2 - (int64_t)(x1 * inverse_grid_size) * grid_size)
+        * inverse_grid_size;
+#endif
+
     _hshg_cell_t start;
     _hshg_cell_t end;
-    _hshg_cell_t folds =
-        (x2 - (_hshg_cell_t)(x1 * hshg->inverse_grid_size) * hshg->grid_size)
-        * hshg->inverse_grid_size;
 
     const _hshg_grid* const grid = hshg->grids;
+    const _hshg_cell_t mask = grid->cells_mask[axis];
 
     switch(folds) {
     case 0:
     {
-        const _hshg_cell_t cell = grid_get_cell_1d(grid, x1);
+        const _hshg_cell_t cell =
+            grid_get_cell_mirror(grid, axis, grid_get_cell_abs(grid, x1));
 
-        end = grid_get_cell_1d(grid, x2);
+        end = grid_get_cell_mirror(grid, axis, grid_get_cell_abs(grid, x2));
         start = min(cell, end);
         end = max(cell, end);
 
@@ -946,19 +4546,19 @@ hshg_map_pos(const _hshg* const hshg, _hshg_cell_t* const ret,
     }
     case 1:
     {
-        const _hshg_cell_t cell = fabsf(x1) * grid->inverse_cell_size;
+        const _hshg_cell_t cell = grid_get_cell_abs(grid, x1);
 
-        end = grid_get_cell_1d(grid, x2);
+        end = grid_get_cell_mirror(grid, axis, grid_get_cell_abs(grid, x2));
 
-        if(cell & grid->cells_side)
+        if(cell & grid->cells_side[axis])
         {
             start = 0;
-            end = max(grid->cells_mask - (cell & grid->cells_mask), end);
+            end = max(mask - (cell & mask), end);
         }
         else
         {
-            start = min(cell & grid->cells_mask, end);
-            end = grid->cells_mask;
+            start = min(cell & mask, end);
+            end = mask;
         }
 
         break;
@@ -966,7 +4566,7 @@ hshg_map_pos(const _hshg* const hshg, _hshg_cell_t* const ret,
     default:
     {
         start = 0;
-        end = grid->cells_mask;
+        end = mask;
 
         break;
     }
@@ -974,6 +4574,7 @@ hshg_map_pos(const _hshg* const hshg, _hshg_cell_t* const ret,
 
     *(ret + 0) = start;
     *(ret + 1) = end;
+#endif /* HSHG_BOUNDED */
 }
 
 
@@ -999,9 +4600,9 @@ _3D(assert(z1 <= z2);)
         _hshg_cell_t end;
     } x _2D(, y) _3D(, z);
 
-    hshg_map_pos(hshg, &x.start, x1, x2);
-_2D(hshg_map_pos(hshg, &y.start, y1, y2);)
-_3D(hshg_map_pos(hshg, &z.start, z1, z2);)
+    hshg_map_pos(hshg, 0, &x.start, x1, x2);
+_2D(hshg_map_pos(hshg, 1, &y.start, y1, y2);)
+_3D(hshg_map_pos(hshg, 2, &z.start, z1, z2);)
 
     const _hshg_grid* grid = hshg->grids;
     const _hshg_grid* const grid_max = hshg->grids + hshg->grids_len;
@@ -1032,20 +4633,75 @@ _3D(z.start >>= shift;)
 _2D(y.end >>= shift;)
 _3D(z.end >>= shift;)
 
+#define query_cell(cell)                                    \
+do                                                          \
+{                                                           \
+    _hshg_entity_t j = hshg_cell_get(hshg, grid, (cell));   \
+    const _hshg_entity_t end = hshg_csr_end(hshg, j);       \
+                                                            \
+    while(j != 0)                                           \
+    {                                                       \
+        const _hshg_entity* const entity =                  \
+            hshg->entities + j;                             \
+                                                            \
+        hshg_prefetch_next(hshg, entity, j, end);           \
+                                                            \
+        if(hshg_entity_in_range(entity,                     \
+            x1 _2D(, y1) _3D(, z1), x2 _2D(, y2) _3D(, z2)))\
+        {                                                   \
+            hshg->query(hshg, entity);                      \
+        }                                                   \
+                                                            \
+        j = hshg_csr_next(entity, j, end);                  \
+    }                                                       \
+}                                                           \
+while(0)
+
     while(1)
     {
+#ifdef HSHG_GHOST
+        /*
+         * The border makes it fine to go one cell past the range on every side,
+         * starting from the first offset of the stencil.
+         */
+        const _hshg_cell_sq_t first = grid->stencil[0] +
+            grid_get_idx(grid, x.start _2D(, y.start) _3D(, z.start));
+
+        const _hshg_cell_t len_x = x.end - x.start + 3;
+    _2D(const _hshg_cell_t len_y = y.end - y.start + 3;)
+    _3D(const _hshg_cell_t len_z = z.end - z.start + 3;)
+
+
+    _3D(for(_hshg_cell_t dz = 0; dz < len_z; ++dz))
+        {
+
+    _2D(for(_hshg_cell_t dy = 0; dy < len_y; ++dy))
+        {
+
+        const _hshg_cell_sq_t row = first
+        _2D(+ dy * grid->stride_y) _3D(+ dz * grid->stride_z);
+
+        for(_hshg_cell_t dx = 0; dx < len_x; ++dx)
+        {
+            query_cell(row + dx);
+        }
+
+        }
+
+        }
+#else
         const _hshg_cell_t s_x = x.start != 0 ? x.start - 1 : 0;
     _2D(const _hshg_cell_t s_y = y.start != 0 ? y.start - 1 : 0;)
     _3D(const _hshg_cell_t s_z = z.start != 0 ? z.start - 1 : 0;)
 
         const _hshg_cell_t e_x =
-            x.end != grid->cells_mask ? x.end + 1 : x.end;
+            x.end != grid->cells_mask[0] ? x.end + 1 : x.end;
 
     _2D(const _hshg_cell_t e_y =
-            y.end != grid->cells_mask ? y.end + 1 : y.end;)
+            y.end != grid->cells_mask[1] ? y.end + 1 : y.end;)
 
     _3D(const _hshg_cell_t e_z =
-            z.end != grid->cells_mask ? z.end + 1 : z.end;)
+            z.end != grid->cells_mask[2] ? z.end + 1 : z.end;)
 
 
     _3D(for(_hshg_cell_t z = s_z; z <= e_z; ++z))
@@ -1056,35 +4712,13 @@ _3D(z.end >>= shift;)
 
         for(_hshg_cell_t x = s_x; x <= e_x; ++x)
         {
-            _hshg_entity_t j;
-
-            const _hshg_cell_sq_t cell =
-                grid_get_idx(grid, x _2D(, y) _3D(, z));
-
-            for(j = grid->cells[cell]; j != 0;)
-            {
-                const _hshg_entity* const entity =
-                    hshg->entities + j;
-
-                if(                                 (
-                    entity->x + entity->r >= x1 &&
-                    entity->x - entity->r <= x2) _2D(&&
-                    entity->y + entity->r >= y1 &&
-                    entity->y - entity->r <= y2) _3D(&&
-                    entity->z + entity->r >= z1 &&
-                    entity->z - entity->r <= z2)
-                )
-                {
-                    hshg->query(hshg, entity);
-                }
-
-                j = entity->next;
-            }
+            query_cell(grid_get_idx(grid, x _2D(, y) _3D(, z)));
         }
 
         }
 
         }
+#endif /* HSHG_GHOST */
 
         if(grid->shift)
         {
@@ -1103,8 +4737,12 @@ _3D(z.end >>= shift;)
             break;
         }
     }
+
+#undef query_cell
 }
 
+#endif /* HSHG_HASHED */
+
 
 void
 _hshg_query(_hshg* const hshg
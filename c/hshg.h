@@ -36,6 +36,7 @@ static_assert(__STDC_VERSION__ >= 201112L);
 
 #define hshg_attrib_const __attribute__((const))
 #define hshg_attrib_unused __attribute__((unused))
+#define hshg_attrib_always_inline __attribute__((always_inline))
 
 
 #include <stddef.h>
@@ -90,6 +91,202 @@ static_assert(__STDC_VERSION__ >= 201112L);
 #endif
 
 
+/*
+ * Define HSHG_MORTON to lay out cells of every grid in Morton (Z-order) order
+ * instead of row by row. Cells that are close to each other in space are then
+ * mostly close to each other in memory too, so after hshg_optimize(), whole
+ * neighbourhoods of cells visited by hshg_collide() and hshg_query() share
+ * cache lines and pages. It makes no difference in 1D.
+ */
+
+/*
+ * Define HSHG_SPARSE to only store cells that have any entities in them, in an
+ * open addressing hash table sized after the number of entities, instead of
+ * allocating all of them up front. Memory usage then doesn't depend on the
+ * number of cells, which allows for very fine grids, especially in 3D, at the
+ * cost of a hash table lookup per visited cell. In that mode, `cells_len` is
+ * the capacity of the table, `cells` are its slots, `keys` are the cells the
+ * slots belong to, and `cells` of every grid is the index of its first cell.
+ */
+
+#ifdef HSHG_SPARSE
+#define _HSHG_SPARSE(...) __VA_ARGS__
+#define _HSHG_DENSE(...)
+#else
+#define _HSHG_SPARSE(...)
+#define _HSHG_DENSE(...) __VA_ARGS__
+#endif
+
+/*
+ * Define HSHG_COMPACT to pack the grid of every entity into the highest 5 bits
+ * of its cell instead of a separate byte, which is otherwise mostly padding.
+ * The number of cells in a grid must then fit in the remaining bits.
+ *
+ * Define HSHG_SINGLY_LINKED to drop `prev` from entities. The predecessor of
+ * an entity is then found by walking its cell from the beginning, which makes
+ * removing and moving entities slower in crowded cells, and makes
+ * hshg_optimize_incremental() walk the list of free entities too.
+ */
+
+#ifdef HSHG_COMPACT
+#define _HSHG_COMPACT(...) __VA_ARGS__
+#else
+#define _HSHG_COMPACT(...)
+#endif
+
+#ifdef HSHG_SINGLY_LINKED
+#define _HSHG_PREV(...)
+#else
+#define _HSHG_PREV(...) __VA_ARGS__
+#endif
+
+/*
+ * Define HSHG_BOUNDED if the world fits in [0, grid_size) on every axis. The
+ * grid is then not mirrored, and a position maps to a cell by a multiplication
+ * (or a shift) clamped to the grid, so entities outside of it end up in cells
+ * on its edges. That makes finding cells and setting up ranges of queries and
+ * collisions much cheaper, but entities far outside are all crammed together.
+ */
+
+/*
+ * Define HSHG_HASHED for worlds much bigger than the HSHG, where mirroring
+ * would fold distant clusters of entities onto the same cells. Coordinates of
+ * cells are then not bounded, and a hash of them picks one of the cells of the
+ * grid, so far apart cells rarely end up together. Neighbours are found by
+ * their coordinates, and entities of other cells that share the same one are
+ * skipped, so hshg_collide() and hshg_query() report every entity only once.
+ * Entities of the biggest grid can be of any size, so all of them share its
+ * first cell.
+ */
+
+#ifdef HSHG_HASHED
+#define _HSHG_HASHED(...) __VA_ARGS__
+
+#if defined(HSHG_BOUNDED) || defined(HSHG_MORTON)
+#error HSHG_HASHED cannot be combined with HSHG_BOUNDED or HSHG_MORTON.
+#endif
+#else
+#define _HSHG_HASHED(...)
+#endif
+
+/*
+ * Define HSHG_LOOSE to let entities stray up to a quarter of a cell out of
+ * their cell before hshg_move() moves them to another one, so that entities
+ * jittering around a border don't keep hopping between two cells. To keep
+ * neighbouring cells enough for hshg_collide() and hshg_query(), entities are
+ * then put in grids with cells twice as big as usual.
+ */
+
+#ifdef HSHG_LOOSE
+#define _HSHG_LOOSE(...) __VA_ARGS__
+
+#ifdef HSHG_HASHED
+#error HSHG_LOOSE cannot be combined with HSHG_HASHED.
+#endif
+#else
+#define _HSHG_LOOSE(...)
+#endif
+
+/*
+ * Define HSHG_GHOST to surround every grid with a border of cells that always
+ * stay empty. Neighbours of any cell can then be visited without checking if
+ * they exist, through a table of `stencil` offsets from the cell, sorted so
+ * that the ones after the middle are the half visited by hshg_collide().
+ */
+
+#ifdef HSHG_GHOST
+#define _HSHG_GHOST(...) __VA_ARGS__
+
+#if defined(HSHG_HASHED) || defined(HSHG_MORTON)
+#error HSHG_GHOST cannot be combined with HSHG_HASHED or HSHG_MORTON.
+#endif
+#else
+#define _HSHG_GHOST(...)
+#endif
+
+#define HSHG_STENCIL_LEN (3 _2D(* 3) _3D(* 3))
+
+/*
+ * Define HSHG_STATIC_SIDE and HSHG_STATIC_CELL_SIZE to the arguments that
+ * hshg_create() will always be called with to make the geometry of all grids
+ * known at compile time. hshg_collide() then gets a copy of its code for every
+ * grid, in which all sides, masks and shifts are constants.
+ */
+
+#if defined(HSHG_STATIC_SIDE) != defined(HSHG_STATIC_CELL_SIZE)
+#error HSHG_STATIC_SIDE and HSHG_STATIC_CELL_SIZE must be defined together.
+#endif
+
+#if defined(HSHG_STATIC_SIDE) && \
+    (defined(HSHG_HASHED) || defined(HSHG_GHOST))
+#error HSHG_STATIC_SIDE cannot be combined with HSHG_HASHED or HSHG_GHOST.
+#endif
+
+/*
+ * Define HSHG_CSR to have hshg_optimize() and hshg_rebuild() remember where
+ * every cell's range of entities ends, since entities of a cell are next to
+ * each other after them. Until anything is relinked, hshg_collide() and
+ * hshg_query() then go over cells as plain ranges of the array instead of
+ * following `next` from one entity to another.
+ */
+
+#ifdef HSHG_CSR
+#define _HSHG_CSR(...) __VA_ARGS__
+#else
+#define _HSHG_CSR(...)
+#endif
+
+/*
+ * Define HSHG_PREFETCH to a number of entities to have hshg_collide() prefetch
+ * heads of cells around the entity that many entities further in the array.
+ * Both hshg_collide() and hshg_query() also prefetch the next entity of a cell
+ * before calling the callback on the current one, or with HSHG_CSR, the entity
+ * that many entities further in the cell's range.
+ */
+
+#if defined(HSHG_PREFETCH) && HSHG_PREFETCH < 1
+#error HSHG_PREFETCH must be a positive number of entities.
+#endif
+
+/*
+ * Define HSHG_SLEEP to let entities be put to sleep with hshg_sleep() and woken
+ * up with hshg_wake(). The update functions then go over a bitmap of awake
+ * entities instead of the whole array, so their cost depends on how many are
+ * awake, not on how many there are. Sleeping entities still collide, can be
+ * queried and are moved by hshg_sync_positions().
+ * With HSHG_COMPACT, the flag takes another bit from the cell of every entity.
+ */
+
+#ifdef HSHG_SLEEP
+#define _HSHG_SLEEP(...) __VA_ARGS__
+#else
+#define _HSHG_SLEEP(...)
+#endif
+
+/*
+ * Define HSHG_HUGEPAGES to get hshg_hugepage_allocator, which maps big blocks
+ * of memory straight from the kernel and asks for them to be backed by huge
+ * pages, so that big arrays of cells and entities need fewer TLB entries.
+ */
+
+#if defined(HSHG_HUGEPAGES) && !defined(__linux__)
+#error HSHG_HUGEPAGES is only available on Linux.
+#endif
+
+#if defined(HSHG_HUGEPAGES) && !defined(HSHG_HUGEPAGE_SIZE)
+#define HSHG_HUGEPAGE_SIZE ((size_t) 2 << 20)
+#endif
+
+/*
+ * Alignment that `entities` and `cells` are allocated with, so that entities
+ * and rows of cells straddle as few cache lines as possible.
+ */
+
+#ifndef HSHG_CACHE_LINE
+#define HSHG_CACHE_LINE 64
+#endif
+
+
 
 /**
  * A type that will be able to hold the maximum number of entities that the
@@ -158,12 +355,30 @@ typedef __hshg_cell_sq_t _hshg_cell_sq_t;
 
 /**
  * A type for x, y, z, and radius values used throughout a HSHG.
+ *
+ * Define HSHG_INTEGER to use a signed integer type instead, `int32_t` by
+ * default, for instance for fixed-point positions. Since sizes of cells are
+ * powers of 2, cells are then found with shifts and masks only, without any
+ * conversions to or from floating-point numbers, so the results are exactly
+ * the same on any machine.
  */
 #define __hshg_pos_t HSHG_NAME(pos_t)
 
+#ifdef HSHG_INTEGER
+#define _HSHG_INTEGER(...) __VA_ARGS__
+#define _HSHG_FLOAT(...)
+#else
+#define _HSHG_INTEGER(...)
+#define _HSHG_FLOAT(...) __VA_ARGS__
+#endif
+
 #ifndef hshg_pos_t
+#ifdef HSHG_INTEGER
+#define hshg_pos_t int32_t
+#else
 #define hshg_pos_t float
 #endif
+#endif
 
 typedef hshg_pos_t
 #undef hshg_pos_t
@@ -175,17 +390,49 @@ typedef __hshg_pos_t _hshg_pos_t;
 
 
 
-#define __hshg_entity_t     \
-{                           \
-    _hshg_cell_sq_t cell;   \
-    uint8_t grid;           \
-    _hshg_entity_t next;    \
-    _hshg_entity_t prev;    \
-    _hshg_entity_t ref;     \
-    _hshg_pos_t x;          \
-_2D(_hshg_pos_t y;)         \
-_3D(_hshg_pos_t z;)         \
-    _hshg_pos_t r;          \
+/**
+ * An optional type for user data stored inline in every entity, right next to
+ * its position. Unlike data kept in a separate array indexed by `ref`, it is
+ * moved along with the entity by hshg_optimize(), so it stays in cache for all
+ * callbacks. The HSHG never reads it, so hshg.collide may write it by casting
+ * away the `const` of its entities. Leave undefined to not store anything.
+ */
+#define __hshg_user_t HSHG_NAME(user_t)
+
+#ifdef hshg_user_t
+
+#define _HSHG_USER(...) __VA_ARGS__
+
+typedef hshg_user_t
+#undef hshg_user_t
+    __hshg_user_t;
+
+typedef __hshg_user_t _hshg_user_t;
+
+#else
+
+#define _HSHG_USER(...)
+
+#endif
+
+#undef __hshg_user_t
+
+
+
+#define __hshg_entity_t                                    \
+{                                                          \
+    _hshg_cell_sq_t cell _HSHG_COMPACT(:                   \
+        sizeof(_hshg_cell_sq_t) * 8 - 5 _HSHG_SLEEP(- 1)); \
+    uint8_t grid _HSHG_COMPACT(: 5);                       \
+_HSHG_SLEEP(uint8_t asleep _HSHG_COMPACT(: 1);)            \
+    _hshg_entity_t next;                                   \
+_HSHG_PREV(_hshg_entity_t prev;)                           \
+    _hshg_entity_t ref;                                    \
+    _hshg_pos_t x;                                         \
+_2D(_hshg_pos_t y;)                                        \
+_3D(_hshg_pos_t z;)                                        \
+    _hshg_pos_t r;                                         \
+_HSHG_USER(_hshg_user_t user;)                             \
 }
 
 #define __hshg_entity HSHG_NAME(entity)
@@ -198,18 +445,34 @@ typedef struct __hshg_entity __hshg_entity_t _hshg_entity;
 
 #define __hshg_grid_t                       \
 {                                           \
-    _hshg_entity_t* const cells;            \
+_HSHG_DENSE(_hshg_entity_t* const cells;)   \
+_HSHG_SPARSE(const _hshg_cell_sq_t cells;)  \
                                             \
-    const _hshg_cell_t cells_side;          \
+    const _hshg_cell_t cells_side[HSHG_D];  \
 _3D(const _hshg_cell_sq_t cells_sq;)        \
-    const _hshg_cell_t cells_mask;          \
+    const _hshg_cell_t cells_mask[HSHG_D];  \
                                             \
 _2D(const uint8_t cells2d_log;)             \
 _3D(const uint8_t cells3d_log;)             \
+_HSHG_HASHED(const uint8_t cells_log;)      \
+                                            \
+_HSHG_GHOST(                                \
+_2D(const _hshg_cell_sq_t stride_y;)        \
+_3D(const _hshg_cell_sq_t stride_z;)        \
+    const _hshg_cell_sq_t                   \
+        stencil[HSHG_STENCIL_LEN];          \
+)                                           \
                                             \
     uint8_t shift;                          \
+_HSHG_INTEGER(const uint8_t cell_log;)      \
                                             \
+_HSHG_FLOAT(                                \
     const _hshg_pos_t inverse_cell_size;    \
+)                                           \
+                                            \
+_HSHG_LOOSE(                                \
+    const _hshg_pos_t loose_margin;         \
+)                                           \
                                             \
     _hshg_entity_t entities_len;            \
 }
@@ -252,6 +515,10 @@ typedef __hshg_const_update_t _hshg_const_update_t;
 
 
 
+/**
+ * Called by hshg_collide() with every pair of entities whose boxes overlap.
+ * Entities may not be changed from it, except for their user data, if any.
+ */
 #define __hshg_collide_t HSHG_NAME(collide_t)
 
 typedef void (*__hshg_collide_t)(const _hshg*,
@@ -273,15 +540,58 @@ typedef __hshg_query_t _hshg_query_t;
 
 
 
+/**
+ * Must block until all threads taking part in a multithreaded function reach
+ * it, like pthread_barrier_wait().
+ */
+#define __hshg_barrier_t HSHG_NAME(barrier_t)
+
+typedef void (*__hshg_barrier_t)(const _hshg*);
+
+typedef __hshg_barrier_t _hshg_barrier_t;
+
+#undef __hshg_barrier_t
+
+
+
+/**
+ * Where a HSHG gets its memory from. Every function is passed `ctx` first,
+ * and the alignment the memory needs to have last, which is more than what
+ * malloc() guarantees only for `entities` and `cells`. `calloc` must return
+ * zeroed memory, `realloc` must act like `malloc` given NULL and leave the old
+ * memory alone if it fails, and `free` must accept NULL.
+ */
+#define __hshg_allocator HSHG_NAME(allocator)
+
+struct __hshg_allocator
+{
+    void* ctx;
+    void* (*malloc)(void* ctx, size_t size, size_t align);
+    void* (*calloc)(void* ctx, size_t size, size_t align);
+    void* (*realloc)(void* ctx, void* ptr, size_t size, size_t align);
+    void (*free)(void* ctx, void* ptr);
+};
+
+typedef struct __hshg_allocator _hshg_allocator;
+
+#undef __hshg_allocator
+
+
+
 #define __hshg_t                            \
 {                                           \
     _hshg_entity* entities;                 \
     _hshg_entity_t* const cells;            \
+_HSHG_SPARSE(_hshg_cell_sq_t* const keys;)  \
+    uint64_t* const cells_used;             \
                                             \
     _hshg_update_t update;                  \
     _hshg_const_update_t const_update;      \
     _hshg_collide_t collide;                \
     _hshg_query_t query;                    \
+    _hshg_barrier_t barrier;                \
+                                            \
+    const _hshg_allocator allocator;        \
                                             \
     const uint8_t cell_log;                 \
     const uint8_t grids_len;                \
@@ -297,12 +607,21 @@ typedef __hshg_query_t _hshg_query_t;
         uint8_t calling;                    \
     };                                      \
     uint8_t removed:1;                      \
+    uint8_t relinking:1;                    \
+_HSHG_CSR(uint8_t csr:1;)                   \
                                             \
     uint32_t old_cache;                     \
     uint32_t new_cache;                     \
                                             \
-    const _hshg_cell_sq_t grid_size;        \
-    const _hshg_pos_t inverse_grid_size;    \
+    const _hshg_cell_sq_t                   \
+        grid_size[HSHG_D];                  \
+_HSHG_FLOAT(                                \
+    const _hshg_pos_t                       \
+        inverse_grid_size[HSHG_D];          \
+)                                           \
+_HSHG_INTEGER(                              \
+    const uint8_t grid_log[HSHG_D];         \
+)                                           \
     const _hshg_cell_sq_t cells_len;        \
     const uint32_t cell_size;               \
                                             \
@@ -311,6 +630,20 @@ typedef __hshg_query_t _hshg_query_t;
     _hshg_entity_t entities_size;           \
     _hshg_entity_t entity_id;               \
                                             \
+    _hshg_cell_sq_t optimize_cell;          \
+    _hshg_entity_t optimize_idx;            \
+                                            \
+    _hshg_entity* optimize_entities;        \
+    _hshg_entity_t* optimize_counts;        \
+                                            \
+_HSHG_CSR(_hshg_entity_t* csr_ends;)        \
+_HSHG_SLEEP(uint64_t* awake;)               \
+                                            \
+    _hshg_entity_t* update_commands;        \
+    _hshg_entity_t* update_counts;          \
+    uint64_t* update_removed;               \
+    uint8_t update_threads;                 \
+                                            \
     _hshg_grid grids[];                     \
 }
 
@@ -333,6 +666,79 @@ _hshg_create(const _hshg_cell_t side, const uint32_t size);
 
 
 
+/**
+ * Same as hshg_create(), but with a different number of cells on every axis,
+ * for worlds that are much longer in one direction than in another. Every
+ * coarser grid halves the number of cells on every axis, but never below 1.
+ * Not available together with HSHG_MORTON, which requires all sides to be
+ * equal.
+ *
+ * \param side_x the number of cells on the smallest grid's X axis
+ * \param side_y the number of cells on the smallest grid's Y axis
+ * \param side_z the number of cells on the smallest grid's Z axis
+ * \param size smallest cell size
+ */
+#define _hshg_create_rect HSHG_NAME(create_rect)
+
+extern _hshg*
+_hshg_create_rect(const _hshg_cell_t side_x _2D(, const _hshg_cell_t side_y)
+    _3D(, const _hshg_cell_t side_z), const uint32_t size);
+
+
+
+/**
+ * Same as hshg_create(), but all memory of the HSHG, including the structure
+ * itself, comes from the given allocator, which is copied.
+ *
+ * \param side the number of cells on the smallest grid's edge
+ * \param size smallest cell size
+ * \param allocator where to allocate memory from, or NULL for the default
+ */
+#define _hshg_create_alloc HSHG_NAME(create_alloc)
+
+extern _hshg*
+_hshg_create_alloc(const _hshg_cell_t side, const uint32_t size,
+    const _hshg_allocator* const allocator);
+
+
+
+/**
+ * Same as hshg_create_rect(), but with an allocator like hshg_create_alloc().
+ */
+#define _hshg_create_rect_alloc HSHG_NAME(create_rect_alloc)
+
+extern _hshg*
+_hshg_create_rect_alloc(const _hshg_cell_t side_x
+    _2D(, const _hshg_cell_t side_y) _3D(, const _hshg_cell_t side_z),
+    const uint32_t size, const _hshg_allocator* const allocator);
+
+
+
+/**
+ * The default allocator, which uses malloc() and friends, and aligned_alloc()
+ * for alignments bigger than what they guarantee.
+ */
+#define _hshg_libc_allocator HSHG_NAME(libc_allocator)
+
+extern const _hshg_allocator _hshg_libc_allocator;
+
+
+
+#ifdef HSHG_HUGEPAGES
+
+/**
+ * An allocator that maps blocks of at least HSHG_HUGEPAGE_SIZE bytes with
+ * mmap() and advises the kernel to back them with transparent huge pages.
+ * Smaller blocks come from aligned_alloc(). Only with HSHG_HUGEPAGES.
+ */
+#define _hshg_hugepage_allocator HSHG_NAME(hugepage_allocator)
+
+extern const _hshg_allocator _hshg_hugepage_allocator;
+
+#endif /* HSHG_HUGEPAGES */
+
+
+
 #define _hshg_free HSHG_NAME(free)
 
 extern void
@@ -344,7 +750,7 @@ _hshg_free(_hshg* const);
  * Returns the maximum amount of memory a HSHG with given parameters will use,
  * NOT including the usage of `hshg_optimize()`. If you also need to take that
  * function into consideration, double the maximum number of entities you pass
- * to this function.
+ * to this function. `hshg_optimize_inplace()` doesn't use any extra memory.
  *
  * The number of entities you pass must include the zero entity as well, so
  * per one full array of entities you need to add 1. If you want to also
@@ -362,6 +768,18 @@ _hshg_memory_usage(const _hshg_cell_t side, const _hshg_entity_t entities_max);
 
 
 
+/**
+ * Same as hshg_memory_usage(), but for hshg_create_rect().
+ */
+#define _hshg_memory_usage_rect HSHG_NAME(memory_usage_rect)
+
+extern size_t
+_hshg_memory_usage_rect(const _hshg_cell_t side_x
+    _2D(, const _hshg_cell_t side_y) _3D(, const _hshg_cell_t side_z),
+    const _hshg_entity_t entities_max);
+
+
+
 #define _hshg_set_size HSHG_NAME(set_size)
 
 extern int
@@ -369,11 +787,16 @@ _hshg_set_size(_hshg* const, const _hshg_entity_t size);
 
 
 
+/**
+ * \param user the initial value of the entity's inline user data, only present
+ * if `hshg_user_t` is defined
+ */
 #define _hshg_insert HSHG_NAME(insert)
 
 extern int
 _hshg_insert(_hshg* const, const _hshg_pos_t x _2D(, const _hshg_pos_t y)
-    _3D(, const _hshg_pos_t z), const _hshg_pos_t r, const _hshg_entity_t ref);
+    _3D(, const _hshg_pos_t z), const _hshg_pos_t r, const _hshg_entity_t ref
+    _HSHG_USER(, const _hshg_user_t user));
 
 
 
@@ -398,6 +821,23 @@ _hshg_resize(_hshg* const);
 
 
 
+/**
+ * Moves the origin of the coordinate system to the given point, subtracting it
+ * from positions of all entities in one pass. Because of mirroring, the grid
+ * repeats itself every 2 * grid_size, so if every coordinate of the point is a
+ * multiple of that, entities stay in the same cells and nothing is relinked.
+ * Otherwise, and always with HSHG_BOUNDED, entities that end up in a different
+ * cell are moved like with hshg_move(). Useful to keep positions small, where
+ * they are most precise.
+ */
+#define _hshg_rebase HSHG_NAME(rebase)
+
+extern void
+_hshg_rebase(_hshg* const, const _hshg_pos_t x
+    _2D(, const _hshg_pos_t y) _3D(, const _hshg_pos_t z));
+
+
+
 #define _hshg_update HSHG_NAME(update)
 
 extern void
@@ -405,6 +845,40 @@ _hshg_update(_hshg* const);
 
 
 
+#ifdef HSHG_SLEEP
+
+/**
+ * Puts the entity to sleep, so that hshg_update(), hshg_update_multithread()
+ * and hshg_update_relink_multithread() skip it until it's woken up with
+ * hshg_wake(). hshg_sync_positions() still moves it. Entities are awake when
+ * inserted. May be called from any callback or outside of them, but not from
+ * more than one thread at a time, except that multithreaded update callbacks
+ * may call it on the entity they are given. Only available with HSHG_SLEEP.
+ *
+ * \param entity the entity to put to sleep
+ */
+#define _hshg_sleep HSHG_NAME(sleep)
+
+extern void
+_hshg_sleep(const _hshg* const, const _hshg_entity* const entity);
+
+
+
+/**
+ * Wakes the entity up, so that the update functions call the update callback
+ * on it again. Same rules as for hshg_sleep() apply.
+ *
+ * \param entity the entity to wake up
+ */
+#define _hshg_wake HSHG_NAME(wake)
+
+extern void
+_hshg_wake(const _hshg* const, const _hshg_entity* const entity);
+
+#endif /* HSHG_SLEEP */
+
+
+
 /**
  * Multithreaded update.
  *
@@ -420,6 +894,74 @@ _hshg_update_multithread(const _hshg* const,
 
 
 
+/**
+ * Multithreaded update in which hshg.const_update may also change positions
+ * and radii of entities, and remove them with hshg_remove_multithread().
+ * Entities don't need hshg_move() or hshg_resize(). Instead, every thread
+ * records which of its entities need to be relinked, and once all of them are
+ * done, every thread relinks the ones in its own range of cells. All threads
+ * must call it at the same time, and hshg.barrier must be set.
+ *
+ * \param threads total number of threads used
+ * \param idx index of the thread calling the function at the moment, counting
+ * from 0
+ *
+ * \return -1 in all threads if out of memory, 0 otherwise
+ */
+#define _hshg_update_relink_multithread HSHG_NAME(update_relink_multithread)
+
+extern int
+_hshg_update_relink_multithread(_hshg* const,
+    const uint8_t threads, const uint8_t idx);
+
+
+
+/**
+ * Removes the given entity once hshg_update_relink_multithread() is done with
+ * the update. May only be called from within hshg.const_update() during it,
+ * for the entity that it was called with.
+ */
+#define _hshg_remove_multithread HSHG_NAME(remove_multithread)
+
+extern void
+_hshg_remove_multithread(const _hshg* const, const _hshg_entity* const);
+
+
+
+/**
+ * Copies positions of all entities from the given arrays, and their radii too
+ * if `rs` isn't NULL, and relinks the ones that end up in another cell or
+ * grid. Arrays are indexed by refs of entities, so every ref must be a valid
+ * index into them. Replaces an hshg.update that does nothing but copy the
+ * position and call hshg_move().
+ */
+#define _hshg_sync_positions HSHG_NAME(sync_positions)
+
+extern void
+_hshg_sync_positions(_hshg* const, const _hshg_pos_t* const xs
+    _2D(, const _hshg_pos_t* const ys) _3D(, const _hshg_pos_t* const zs),
+    const _hshg_pos_t* const rs);
+
+
+
+/**
+ * Multithreaded hshg_sync_positions(), relinking entities the same way as
+ * hshg_update_relink_multithread(). All threads must call it at the same time
+ * with the same arrays, and hshg.barrier must be set.
+ *
+ * \return -1 in all threads if out of memory, 0 otherwise
+ */
+#define _hshg_sync_positions_multithread \
+    HSHG_NAME(sync_positions_multithread)
+
+extern int
+_hshg_sync_positions_multithread(_hshg* const,
+    const uint8_t threads, const uint8_t idx, const _hshg_pos_t* const xs
+    _2D(, const _hshg_pos_t* const ys) _3D(, const _hshg_pos_t* const zs),
+    const _hshg_pos_t* const rs);
+
+
+
 #define _hshg_update_cache HSHG_NAME(update_cache)
 
 extern void
@@ -441,6 +983,148 @@ _hshg_optimize(_hshg* const);
 
 
 
+/**
+ * Multithreaded hshg_optimize(), resulting in the exact same order of
+ * entities. Every thread counts entities in its own range of cells, and then
+ * copies them to where the counts of all previous threads end. All threads
+ * must call it at the same time, and hshg.barrier must be set.
+ *
+ * \param threads total number of threads used
+ * \param idx index of the thread calling the function at the moment, counting
+ * from 0
+ *
+ * \return -1 in all threads if out of memory, 0 otherwise
+ */
+#define _hshg_optimize_multithread HSHG_NAME(optimize_multithread)
+
+extern int
+_hshg_optimize_multithread(_hshg* const,
+    const uint8_t threads, const uint8_t idx);
+
+
+
+/**
+ * Puts every entity in the cell and grid of its current position and radius,
+ * ignoring the cell it's linked to, and lays entities out like hshg_optimize()
+ * does, in one pass. Meant to be called after an hshg_update() that changed
+ * positions and radii without calling hshg_move() or hshg_resize(), when most
+ * entities would be relinked anyway. Entities of the same cell keep their
+ * relative order instead of the order of their list.
+ *
+ * \return -1 if out of memory, 0 otherwise
+ */
+#define _hshg_rebuild HSHG_NAME(rebuild)
+
+extern int
+_hshg_rebuild(_hshg* const);
+
+
+
+/**
+ * Multithreaded hshg_rebuild(). Every thread sorts its own range of cells.
+ * All threads must call it at the same time, and hshg.barrier must be set.
+ *
+ * \param threads total number of threads used
+ * \param idx index of the thread calling the function at the moment, counting
+ * from 0
+ *
+ * \return -1 in all threads if out of memory, 0 otherwise
+ */
+#define _hshg_rebuild_multithread HSHG_NAME(rebuild_multithread)
+
+extern int
+_hshg_rebuild_multithread(_hshg* const,
+    const uint8_t threads, const uint8_t idx);
+
+
+
+/**
+ * Changes the geometry of the HSHG as if it was created again with the given
+ * arguments, keeping all entities where they are in the array. Every entity is
+ * put in the grid and cell it belongs to in the new geometry in one pass, with
+ * entities of every cell linked in the order of the array. Callbacks, the
+ * allocator and the size of the array carry over. Since the number of grids may
+ * change, the HSHG may be moved in memory.
+ *
+ * \param side the number of cells on the smallest grid's edge
+ * \param size smallest cell size
+ *
+ * \return the HSHG, which the old pointer must be replaced with, or NULL if out
+ * of memory, in which case the old HSHG is left as it was
+ */
+#define _hshg_regrid HSHG_NAME(regrid)
+
+extern _hshg*
+_hshg_regrid(_hshg* const, const _hshg_cell_t side, const uint32_t size);
+
+
+
+/**
+ * Same as hshg_regrid(), but with arguments like hshg_create_rect().
+ */
+#define _hshg_regrid_rect HSHG_NAME(regrid_rect)
+
+extern _hshg*
+_hshg_regrid_rect(_hshg* const, const _hshg_cell_t side_x
+    _2D(, const _hshg_cell_t side_y) _3D(, const _hshg_cell_t side_z),
+    const uint32_t size);
+
+
+
+/**
+ * Same as hshg_optimize(), resulting in the exact same order of entities, but
+ * reorders them within the existing array instead of allocating a new one.
+ * Can't fail, at the cost of being somewhat slower.
+ */
+#define _hshg_optimize_inplace HSHG_NAME(optimize_inplace)
+
+extern void
+_hshg_optimize_inplace(_hshg* const);
+
+
+
+/**
+ * Does a part of what hshg_optimize() does, continuing from where the last
+ * call left off. Cells are visited in order and their entities are moved to
+ * the front of the array, so that after enough calls the entities end up in
+ * the same order as after hshg_optimize(), without ever stalling for the
+ * whole array at once. Call it once per tick to keep entities sorted.
+ *
+ * A cell is never left half done, so the entity budget may be exceeded by up
+ * to the number of entities in one cell.
+ *
+ * \param cells the maximum number of cells to visit
+ * \param entities the maximum number of entities to move
+ *
+ * \return 1 if this call finished a full pass over all cells, 0 otherwise
+ */
+#define _hshg_optimize_incremental HSHG_NAME(optimize_incremental)
+
+extern int
+_hshg_optimize_incremental(_hshg* const,
+    _hshg_cell_sq_t cells, _hshg_entity_t entities);
+
+
+
+/**
+ * Moves entities from the end of the array into holes left by removed ones,
+ * only fixing up their neighbours, until there are no holes left. Unlike with
+ * hshg_optimize(), the order of entities otherwise stays the same. The array
+ * can then be shrunk with hshg_set_size(hshg, hshg->entities_used).
+ *
+ * \param moved NULL, or room for twice as many indices as there are holes,
+ * which is never more than 2 * (hshg->entities_used - 1). For every moved
+ * entity, its old index is written, followed by its new one.
+ *
+ * \return the number of moved entities
+ */
+#define _hshg_compact HSHG_NAME(compact)
+
+extern _hshg_entity_t
+_hshg_compact(_hshg* const, _hshg_entity_t* const moved);
+
+
+
 #define _hshg_query HSHG_NAME(query)
 
 extern void
@@ -1,8 +1,18 @@
 #define HSHG_UNIFORM
+#define hshg_user_t uint32_t
 #include "hshg.c"
 
+/*
+ * Tests check their results even if the HSHG itself is built without
+ * assertions.
+ */
+#undef NDEBUG
+
 #include <stdio.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #define unused __attribute__((unused))
 
@@ -58,7 +68,9 @@ ret_obj(int idx)
 void
 insert(hshg_pos_t x _2D(, hshg_pos_t y) _3D(, hshg_pos_t z), hshg_pos_t r)
 {
-    assert(!hshg_insert(hshg, x _2D(, y) _3D(, z), r, get_obj()));
+    const int obj = get_obj();
+
+    assert(!hshg_insert(hshg, x _2D(, y) _3D(, z), r, obj, obj));
 }
 
 
@@ -74,6 +86,9 @@ _2D(float dy = a->y - b->y;)
 _3D(float dz = a->z - b->z;)
     float sr = a->r + b->r;
 
+    assert(a->user == a->ref);
+    assert(b->user == b->ref);
+
     if(dx * dx _2D(+ dy * dy) _3D(+ dz * dz) <= sr * sr)
     {
         ++objs[a->ref].count;
@@ -105,7 +120,10 @@ obj_optimize(unused struct hshg* _, struct hshg_entity* ent)
 {
     if(ent->ref == refs[opt_idx])
     {
-        ent->ref = opt_idx++;
+        ent->ref = opt_idx;
+        ent->user = opt_idx;
+
+        ++opt_idx;
     }
 }
 
@@ -203,99 +221,1161 @@ do                                          \
 while(0)
 
 
+struct snapshot
+{
+    hshg_entity_t used;
+    hshg_entity_t free_entity;
+    struct hshg_entity* entities;
+    hshg_entity_t* cells;
+};
+
+
 void
-upd(unused struct hshg* _, struct hshg_entity* ent)
+snapshot_take(struct snapshot* snap)
 {
-    ++objs[ent->ref].count;
+    const size_t entities_size =
+        sizeof(struct hshg_entity) * hshg->entities_used;
+    const size_t cells_size = sizeof(hshg_entity_t) * hshg->cells_len;
+
+    snap->used = hshg->entities_used;
+    snap->free_entity = hshg->free_entity;
+    snap->entities = malloc(entities_size);
+    snap->cells = malloc(cells_size);
+
+    assert(snap->entities);
+    assert(snap->cells);
+
+    memcpy(snap->entities, hshg->entities, entities_size);
+    memcpy(snap->cells, hshg->cells, cells_size);
 }
 
 
 void
-change_pos(unused struct hshg* _, struct hshg_entity* ent)
+snapshot_restore(const struct snapshot* snap)
 {
-    --ent->x;
-_2D(++ent->y;)
-_3D(--ent->z;)
+    memcpy(hshg->entities, snap->entities,
+        sizeof(struct hshg_entity) * snap->used);
+    memcpy(hshg->cells, snap->cells, sizeof(hshg_entity_t) * hshg->cells_len);
+
+    hshg->entities_used = snap->used;
+    hshg->free_entity = snap->free_entity;
 }
 
 
 void
-revert_pos(unused struct hshg* _, struct hshg_entity* ent)
+snapshot_compare(const struct snapshot* snap)
 {
-    ent->x += 100;
-_2D(ent->y -= 100;)
-_3D(ent->z += 100;)
+    assert_eq(hshg->entities_used, snap->used);
+    assert_eq(hshg->free_entity, snap->free_entity);
+    assert(!memcmp(hshg->cells, snap->cells,
+        sizeof(hshg_entity_t) * hshg->cells_len));
+
+    for(hshg_entity_t i = 1; i < snap->used; ++i)
+    {
+        const struct hshg_entity* a = hshg->entities + i;
+        const struct hshg_entity* b = snap->entities + i;
+
+        assert_eq(a->cell, b->cell);
+        assert_eq(a->grid, b->grid);
+        assert_eq(a->next, b->next);
+#ifndef HSHG_SINGLY_LINKED
+        assert_eq(a->prev, b->prev);
+#endif
+        assert_eq(a->ref, b->ref);
+    }
 }
 
 
-#define _check_count(checks, _len)           \
-do                                           \
-{                                            \
-    int len = _len;                          \
-                                             \
-    assert_eq(obj_count, len);               \
-                                             \
-    for(int i = 0; i < len; ++i)             \
-    {                                        \
-        assert_eq(objs[i].count, checks[i]); \
-    }                                        \
-}                                            \
-while(0)
+void
+snapshot_free(struct snapshot* snap)
+{
+    free(snap->entities);
+    free(snap->cells);
+}
 
 
-#define check_count(checks) \
-_check_count(checks, sizeof(checks) / sizeof(checks[0]))
+#define THREADS 3
 
+pthread_barrier_t barrier;
 
-int did_it;
 
-struct dis
+void
+wait_barrier(unused const struct hshg* _)
 {
-    hshg_pos_t x;
-_2D(hshg_pos_t y;)
-_3D(hshg_pos_t z;)
-    hshg_pos_t r;
-    int del;
-};
+    pthread_barrier_wait(&barrier);
+}
+
+
+/*
+ * Runs the function on THREADS threads at once, passing every one of them its
+ * index, with hshg.barrier waiting for all of them.
+ */
+void
+run_threads(void* (*fn)(void*))
+{
+    pthread_t threads[THREADS];
+
+    hshg->barrier = wait_barrier;
+
+    pthread_barrier_init(&barrier, NULL, THREADS);
+
+    for(uintptr_t i = 0; i < THREADS; ++i)
+    {
+        const int ret = pthread_create(threads + i, NULL, fn, (void*) i);
+
+        assert(!ret);
+    }
+
+    for(int i = 0; i < THREADS; ++i)
+    {
+        const int ret = pthread_join(threads[i], NULL);
+
+        assert(!ret);
+    }
+
+    pthread_barrier_destroy(&barrier);
+}
 
-struct dis old_data;
-struct dis new_data;
+
+void*
+optimize_thread(void* idx)
+{
+    assert(!hshg_optimize_multithread(hshg, THREADS, (uintptr_t) idx));
+
+    return NULL;
+}
 
 
 void
-upd_set(unused struct hshg* _, struct hshg_entity* ent)
+optimize_multithread(void)
 {
-    if(ent->x == old_data.x _2D( && ent->y == old_data.y)
-        _3D( && ent->z == old_data.z) && ent->r == old_data.r)
+    run_threads(optimize_thread);
+}
+
+
+/*
+ * Runs hshg_optimize(), hshg_optimize_inplace() and
+ * hshg_optimize_multithread() on the same state and makes sure they agree.
+ */
+void
+optimize(void)
+{
+    struct snapshot before;
+    struct snapshot after;
+
+    snapshot_take(&before);
+
+    assert(!hshg_optimize(hshg));
+
+    snapshot_take(&after);
+
+    for(hshg_cell_sq_t i = 0; i < hshg->cells_len; ++i)
     {
-        did_it = 1;
+        const int used = (hshg->cells_used[i >> 6] >> (i & 63)) & 1;
+        const int occupied = hshg->cells[i] != 0;
 
-        if(new_data.del)
+        assert_eq(used, occupied);
+    }
+
+    snapshot_restore(&before);
+
+    hshg_optimize_inplace(hshg);
+
+    snapshot_compare(&after);
+
+    snapshot_restore(&before);
+
+    optimize_multithread();
+
+    snapshot_compare(&after);
+
+    snapshot_free(&before);
+    snapshot_free(&after);
+}
+
+
+/*
+ * Converges hshg_optimize_incremental() in small steps, which must not affect
+ * collisions along the way, and must end up in the same order as a full
+ * hshg_optimize() would produce.
+ */
+void
+optimize_incremental(void)
+{
+    col();
+
+    const int expected = col_num;
+
+    while(!hshg_optimize_incremental(hshg, hshg->cells_len / 8 + 1, 1))
+    {
+        col();
+
+        assert_eq(col_num, expected);
+    }
+
+    col();
+
+    assert_eq(col_num, expected);
+
+    struct snapshot snap;
+
+    snapshot_take(&snap);
+
+    assert(!hshg_optimize(hshg));
+
+    snapshot_compare(&snap);
+
+    snapshot_free(&snap);
+}
+
+
+/*
+ * Every other HSHG has a different number of cells on every axis.
+ */
+struct hshg*
+create(const hshg_cell_t side, const uint32_t size)
+{
+#ifndef HSHG_MORTON
+    if(__builtin_ctz(size) & 1)
+    {
+        return hshg_create_rect(side > 4 ? side >> 2 : 1
+            _2D(, side) _3D(, side > 2 ? side >> 1 : 1), size);
+    }
+#endif
+
+    return hshg_create(side, size);
+}
+
+
+void
+check_cells(void)
+{
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        const struct hshg_entity* const entity = hshg->entities + i;
+
+        if(invalid_entity(entity))
         {
-            ret_obj(ent->ref);
+            continue;
+        }
 
-            return hshg_remove(hshg);
+#ifdef HSHG_LOOSE
+        assert(grid_cell_holds(hshg->grids + entity->grid, entity->cell,
+            entity->x _2D(, entity->y) _3D(, entity->z)));
+#else
+        const hshg_cell_sq_t cell = grid_get_cell(hshg->grids + entity->grid,
+            entity->x _2D(, entity->y) _3D(, entity->z));
+
+        assert_eq(entity->cell, cell);
+#endif
+
+#ifdef HSHG_CSR
+        if(hshg->csr)
+        {
+            const hshg_entity_t next = entity->next == 0 ? 0 : i + 1;
+            const hshg_entity_t end =
+                next == 0 ? i + 1 : hshg->csr_ends[i + 1];
+
+            assert_eq(entity->next, next);
+            assert_eq(hshg->csr_ends[i], end);
         }
+#endif
+    }
+}
 
-        ent->x = new_data.x;
-    _2D(ent->y = new_data.y;)
-    _3D(ent->z = new_data.z;)
-        ent->r = new_data.r;
 
-        if(old_data.x != new_data.x _2D( || old_data.y != new_data.y)
-            _3D( || old_data.z != new_data.z))
+/*
+ * Moving the origin by a multiple of the period of the grid, by anything else,
+ * and back, must keep every entity in the right cell and not change anything.
+ */
+void
+rebase(void)
+{
+    col();
+
+    const int expected = col_num;
+    const hshg_pos_t period_x = hshg->grid_size[0] * 2;
+_2D(const hshg_pos_t period_y = hshg->grid_size[1] * 2;)
+_3D(const hshg_pos_t period_z = hshg->grid_size[2] * 2;)
+
+    hshg_rebase(hshg, period_x _2D(, -period_y) _3D(, period_z * 2));
+
+    check_cells();
+    col();
+
+    assert_eq(col_num, expected);
+
+    hshg_rebase(hshg, 3 - period_x
+        _2D(, period_y + 5) _3D(, -7 - period_z * 2));
+
+    check_cells();
+    col();
+
+    assert_eq(col_num, expected);
+
+    hshg_rebase(hshg, -3 _2D(, -5) _3D(, 7));
+
+    check_cells();
+    col();
+
+    assert_eq(col_num, expected);
+}
+
+
+hshg_pos_t sync_x[NUM_OBJ];
+_2D(hshg_pos_t sync_y[NUM_OBJ];)
+_3D(hshg_pos_t sync_z[NUM_OBJ];)
+hshg_pos_t sync_r[NUM_OBJ];
+
+
+void*
+sync_thread(void* idx)
+{
+    assert(!hshg_sync_positions_multithread(hshg, THREADS, (uintptr_t) idx,
+        sync_x _2D(, sync_y) _3D(, sync_z), sync_r));
+
+    return NULL;
+}
+
+
+/*
+ * Syncing every entity somewhere else with a bigger radius and then back from
+ * arrays, with one thread and with many, must keep every entity in the right
+ * cell and leave collisions as they were.
+ */
+void
+sync_positions(void)
+{
+    col();
+
+    const int expected = col_num;
+
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        const struct hshg_entity* const entity = hshg->entities + i;
+
+        if(invalid_entity(entity))
         {
-            hshg_move(hshg);
+            continue;
         }
 
-        if(old_data.r != new_data.r)
+        sync_x[entity->ref] = entity->x + 37;
+    _2D(sync_y[entity->ref] = entity->y - 21;)
+    _3D(sync_z[entity->ref] = entity->z + 5;)
+        sync_r[entity->ref] = entity->r * 3;
+    }
+
+    hshg_sync_positions(hshg, sync_x _2D(, sync_y) _3D(, sync_z), sync_r);
+
+    check_cells();
+
+    for(int i = 0; i < NUM_OBJ; ++i)
+    {
+        sync_x[i] -= 37;
+    _2D(sync_y[i] += 21;)
+    _3D(sync_z[i] -= 5;)
+        sync_r[i] /= 3;
+    }
+
+    run_threads(sync_thread);
+
+    check_cells();
+    col();
+
+    assert_eq(col_num, expected);
+
+    hshg_sync_positions(hshg, sync_x _2D(, sync_y) _3D(, sync_z), NULL);
+
+    check_cells();
+    col();
+
+    assert_eq(col_num, expected);
+}
+
+
+void
+shift_entities(hshg_pos_t x _2D(, hshg_pos_t y) _3D(, hshg_pos_t z))
+{
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        struct hshg_entity* const entity = hshg->entities + i;
+
+        if(invalid_entity(entity))
         {
-            hshg_resize(hshg);
+            continue;
         }
+
+        entity->x += x;
+    _2D(entity->y += y;)
+    _3D(entity->z += z;)
+    }
+}
+
+
+void*
+rebuild_thread(void* idx)
+{
+    assert(!hshg_rebuild_multithread(hshg, THREADS, (uintptr_t) idx));
+
+    return NULL;
+}
+
+
+/*
+ * Moving entities without relinking them and then rebuilding must put every
+ * entity in the right cell, with one thread and with many, and moving them
+ * back must leave collisions as they were.
+ */
+void
+rebuild(void)
+{
+    col();
+
+    const int expected = col_num;
+
+    shift_entities(37 _2D(, -21) _3D(, 5));
+
+    assert(!hshg_rebuild(hshg));
+
+    check_cells();
+
+    shift_entities(-37 _2D(, 21) _3D(, -5));
+
+    run_threads(rebuild_thread);
+
+    check_cells();
+    col();
+
+    assert_eq(col_num, expected);
+}
+
+
+void
+upd(unused struct hshg* _, struct hshg_entity* ent)
+{
+    assert(ent->user == ent->ref);
+
+    ++objs[ent->ref].count;
+}
+
+
+void
+const_upd(unused const struct hshg* _, struct hshg_entity* ent)
+{
+    assert(ent->user == ent->ref);
+
+    ++objs[ent->ref].count;
+}
+
+
+void*
+update_thread(void* idx)
+{
+    hshg_update_multithread(hshg, THREADS, (uintptr_t) idx);
+
+    return NULL;
+}
+
+
+void*
+update_relink_thread(void* idx)
+{
+    assert(!hshg_update_relink_multithread(hshg, THREADS, (uintptr_t) idx));
+
+    return NULL;
+}
+
+
+void*
+update_relink_fail_thread(void* idx)
+{
+    const int ret =
+        hshg_update_relink_multithread(hshg, THREADS, (uintptr_t) idx);
+
+    assert_eq(ret, -1);
+
+    return NULL;
+}
+
+
+void
+check_counts(const int asleep)
+{
+    for(int i = 0; i < obj_count; ++i)
+    {
+        assert_eq(objs[i].count, !(i & asleep));
     }
 }
 
 
+void
+check_updated(const int asleep)
+{
+    reset();
+
+    hshg_update(hshg);
+
+    check_counts(asleep);
+
+    const hshg_const_update_t old = hshg->const_update;
+
+    hshg->const_update = const_upd;
+
+    reset();
+
+    run_threads(update_thread);
+
+    check_counts(asleep);
+
+    reset();
+
+    run_threads(update_relink_thread);
+
+    check_counts(asleep);
+
+    hshg->const_update = old;
+}
+
+
+/*
+ * Every update function must update every entity exactly once. Sleeping
+ * entities must be skipped by all of them, also after entities are moved
+ * around in the array, and must be updated again once woken up.
+ */
+void
+sleep_wake(void)
+{
+    const hshg_update_t old = hshg->update;
+
+    hshg->update = upd;
+
+    check_updated(0);
+
+#ifdef HSHG_SLEEP
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        const struct hshg_entity* const entity = hshg->entities + i;
+
+        if(!invalid_entity(entity) && (entity->ref & 1))
+        {
+            hshg_sleep(hshg, entity);
+        }
+    }
+
+    check_updated(1);
+
+    optimize();
+
+    check_updated(1);
+
+    optimize_incremental();
+
+    check_updated(1);
+
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        const struct hshg_entity* const entity = hshg->entities + i;
+
+        if(!invalid_entity(entity))
+        {
+            hshg_wake(hshg, entity);
+        }
+    }
+
+    check_updated(0);
+#endif
+
+    hshg->update = old;
+}
+
+
+void
+remove_extra(unused struct hshg* _, struct hshg_entity* ent)
+{
+    if(ent->ref >= NUM_OBJ)
+    {
+        hshg_remove(hshg);
+    }
+}
+
+
+void
+remove_first_extra(unused struct hshg* _, struct hshg_entity* ent)
+{
+    if(ent->ref == NUM_OBJ)
+    {
+        hshg_remove(hshg);
+    }
+}
+
+
+hshg_entity_t
+linked_entities(void)
+{
+    hshg_entity_t num = 0;
+
+    for(hshg_cell_sq_t i = hshg_next_cell(hshg, 0);
+        i != hshg->cells_len; i = hshg_next_cell(hshg, i + 1))
+    {
+        for(hshg_entity_t j = hshg->cells[i]; j != 0;
+            j = hshg->entities[j].next)
+        {
+            assert(j < hshg->entities_used);
+            assert(!invalid_entity(hshg->entities + j));
+
+            ++num;
+        }
+    }
+
+    return num;
+}
+
+
+/*
+ * An entity inserted into an already visited cell in the middle of a pass of
+ * hshg_optimize_incremental() lands past the sorted part of the array. Once
+ * another entity is removed from the sorted part, there are as many entities
+ * as before, but the array may not be trimmed over the new one.
+ */
+void
+optimize_incremental_changes(void)
+{
+    assert(!hshg_optimize(hshg));
+
+    col();
+
+    const int expected = col_num;
+    const struct hshg_entity first = hshg->entities[1];
+
+    assert(!hshg_insert(hshg, first.x _2D(, first.y) _3D(, first.z),
+        first.r, NUM_OBJ, NUM_OBJ));
+
+    assert(!hshg_optimize(hshg));
+
+    const int finished = hshg_optimize_incremental(hshg, 1, 1);
+
+    assert(!hshg_insert(hshg, first.x _2D(, first.y) _3D(, first.z),
+        first.r, NUM_OBJ + 1, NUM_OBJ + 1));
+
+    const hshg_update_t old = hshg->update;
+
+    hshg->update = remove_first_extra;
+
+    hshg_update(hshg);
+
+    if(!finished)
+    {
+        while(!hshg_optimize_incremental(hshg, 1, 1));
+    }
+
+    assert_eq(linked_entities(), (hshg_entity_t)(obj_count + 1));
+
+    for(hshg_entity_t i = 2; i < 6; ++i)
+    {
+        assert(!hshg_insert(hshg, first.x _2D(, first.y) _3D(, first.z),
+            first.r, NUM_OBJ + i, NUM_OBJ + i));
+    }
+
+    assert_eq(linked_entities(), (hshg_entity_t)(obj_count + 5));
+
+    check_cells();
+
+    hshg->update = remove_extra;
+
+    hshg_update(hshg);
+
+    hshg->update = old;
+
+    assert_eq(linked_entities(), (hshg_entity_t) obj_count);
+
+    col();
+
+    assert_eq(col_num, expected);
+}
+
+
+/*
+ * Compacting an array with holes in between entities must leave no holes,
+ * report where entities went, keep all of them in the right cell and leave
+ * collisions as they were.
+ */
+void
+compact(void)
+{
+    assert(!hshg_optimize(hshg));
+
+    col();
+
+    const int expected = col_num;
+    const hshg_entity_t used = hshg->entities_used;
+
+    for(hshg_entity_t i = 1; i < used; ++i)
+    {
+        const struct hshg_entity* const entity = hshg->entities + i;
+
+        assert(!hshg_insert(hshg, entity->x _2D(, entity->y) _3D(, entity->z),
+            entity->r, NUM_OBJ + i, NUM_OBJ + i));
+    }
+
+    /*
+     * Extra entities end up next to the ones they were copied from, so that
+     * removing them leaves holes all over the array.
+     */
+    assert(!hshg_optimize(hshg));
+
+    const hshg_update_t old = hshg->update;
+
+    hshg->update = remove_extra;
+
+    hshg_update(hshg);
+
+    hshg->update = old;
+
+    hshg_entity_t refs_before[NUM_OBJ * 2 + 1];
+
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        refs_before[i] = hshg->entities[i].ref;
+    }
+
+    hshg_entity_t moved[NUM_OBJ * 4];
+
+    const hshg_entity_t moved_len = hshg_compact(hshg, moved);
+
+    assert_neq(moved_len, 0);
+    assert_eq(hshg->entities_used, (hshg_entity_t)(obj_count + 1));
+    assert_eq(hshg->free_entity, 0);
+
+    for(hshg_entity_t i = 0; i < moved_len; ++i)
+    {
+        const hshg_entity_t from = moved[i * 2];
+        const hshg_entity_t to = moved[i * 2 + 1];
+
+        assert(to < from);
+        assert_eq(hshg->entities[to].ref, refs_before[from]);
+    }
+
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        assert(!invalid_entity(hshg->entities + i));
+    }
+
+    check_cells();
+    col();
+
+    assert_eq(col_num, expected);
+
+    assert(!hshg_set_size(hshg, hshg->entities_used));
+
+    col();
+
+    assert_eq(col_num, expected);
+}
+
+
+#ifdef HSHG_HUGEPAGES
+#define backend hshg_hugepage_allocator
+#else
+#define backend hshg_libc_allocator
+#endif
+
+int blocks = 0;
+
+/* Number of allocations that succeed before one fails, or -1 for none */
+int allocs_left = -1;
+
+
+int
+alloc_fails(void)
+{
+    return allocs_left >= 0 && allocs_left-- == 0;
+}
+
+
+void*
+count_malloc(unused void* _, size_t size, size_t align)
+{
+    if(alloc_fails())
+    {
+        return NULL;
+    }
+
+    void* const ptr = backend.malloc(backend.ctx, size, align);
+
+    blocks += ptr != NULL;
+
+    return ptr;
+}
+
+
+void*
+count_calloc(unused void* _, size_t size, size_t align)
+{
+    if(alloc_fails())
+    {
+        return NULL;
+    }
+
+    void* const ptr = backend.calloc(backend.ctx, size, align);
+
+    blocks += ptr != NULL;
+
+    return ptr;
+}
+
+
+void*
+count_realloc(unused void* _, void* ptr, size_t size, size_t align)
+{
+    if(alloc_fails())
+    {
+        return NULL;
+    }
+
+    void* const new_ptr = backend.realloc(backend.ctx, ptr, size, align);
+
+    blocks += ptr == NULL && new_ptr != NULL;
+
+    return new_ptr;
+}
+
+
+void
+count_free(unused void* _, void* ptr)
+{
+    blocks -= ptr != NULL;
+
+    backend.free(backend.ctx, ptr);
+}
+
+
+/*
+ * A HSHG made with a custom allocator must get all of its memory from it and
+ * give all of it back, and must behave like any other HSHG. Entities and cells
+ * must be aligned to cache lines, also after growing, and with the huge page
+ * allocator once they are big enough to be mapped.
+ */
+void
+allocator(void)
+{
+    col();
+
+    const int expected = col_num;
+    struct hshg* const old = hshg;
+
+    const struct hshg_allocator counting =
+    {
+        .ctx = NULL,
+        .malloc = count_malloc,
+        .calloc = count_calloc,
+        .realloc = count_realloc,
+        .free = count_free
+    };
+
+    hshg = hshg_create_rect_alloc(old->grids[0].cells_side[0]
+        _2D(, old->grids[0].cells_side[1]) _3D(, old->grids[0].cells_side[2]),
+        old->cell_size, &counting);
+
+    assert(hshg);
+    assert_neq(blocks, 0);
+
+    hshg->collide = old->collide;
+
+    for(hshg_entity_t i = 1; i < old->entities_used; ++i)
+    {
+        const struct hshg_entity* const entity = old->entities + i;
+
+        if(!invalid_entity(entity))
+        {
+            assert(!hshg_insert(hshg, entity->x _2D(, entity->y)
+                _3D(, entity->z), entity->r, entity->ref, entity->user));
+        }
+    }
+
+    col();
+
+    assert_eq(col_num, expected);
+
+    assert(!hshg_optimize(hshg));
+    assert(!hshg_set_size(hshg, 1 << 17));
+
+    col();
+
+    assert_eq(col_num, expected);
+
+    assert_eq((int)((uintptr_t) hshg->entities % HSHG_CACHE_LINE), 0);
+    assert_eq((int)((uintptr_t) hshg->cells % HSHG_CACHE_LINE), 0);
+
+#ifdef HSHG_HUGEPAGES
+    /*
+     * Mapped blocks start right after their header in a huge page.
+     */
+    assert_eq((int)((uintptr_t) hshg->entities % HSHG_HUGEPAGE_SIZE),
+        HSHG_CACHE_LINE);
+#endif
+
+    /*
+     * Whichever array fails to be resized, growing or shrinking, the HSHG must
+     * still be usable and able to rebuild everything it keeps per entity.
+     */
+    for(int i = 0; i < 4; ++i)
+    {
+        const hshg_entity_t size = hshg->entities_size;
+
+        allocs_left = i;
+
+        if(hshg_set_size(hshg, size << 1))
+        {
+            assert_eq(hshg->entities_size, size);
+        }
+
+        allocs_left = i;
+
+        if(hshg_set_size(hshg, hshg->entities_used))
+        {
+            assert_neq(hshg->entities_size, hshg->entities_used);
+        }
+
+        allocs_left = -1;
+
+        hshg_optimize_inplace(hshg);
+
+        col();
+
+        assert_eq(col_num, expected);
+
+        assert(!hshg_set_size(hshg, 1 << 17));
+    }
+
+    assert(!hshg_set_size(hshg, hshg->entities_used));
+
+    col();
+
+    assert_eq(col_num, expected);
+
+    /*
+     * hshg_update_relink_multithread() must fail in all threads at once if it
+     * can't get its buffers, and must not allocate anything once it has them.
+     */
+    hshg->const_update = const_upd;
+
+    allocs_left = 0;
+
+    run_threads(update_relink_fail_thread);
+
+    allocs_left = -1;
+
+    for(int i = 0; i < 2; ++i)
+    {
+        reset();
+
+        run_threads(update_relink_thread);
+
+        check_counts(0);
+
+        allocs_left = 0;
+    }
+
+    allocs_left = -1;
+
+    hshg_free(hshg);
+
+    assert_eq(blocks, 0);
+
+    hshg = old;
+}
+
+#undef backend
+
+
+void
+check_regrid(const int expected)
+{
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i)
+    {
+        const struct hshg_entity* const entity = hshg->entities + i;
+
+        if(!invalid_entity(entity))
+        {
+            assert_eq(entity->grid, hshg_get_grid(hshg, entity->r));
+            assert(entity->next == 0 || entity->next > i);
+        }
+    }
+
+    check_cells();
+    col();
+
+    assert_eq(col_num, expected);
+}
+
+
+/*
+ * Changing the geometry and changing it back must put every entity in the
+ * right grid and cell, with cells listing entities in the order of the array,
+ * and leave collisions as they were.
+ */
+void
+regrid(void)
+{
+    col();
+
+    const int expected = col_num;
+    const hshg_cell_t side_x = hshg->grids[0].cells_side[0];
+_2D(const hshg_cell_t side_y = hshg->grids[0].cells_side[1];)
+_3D(const hshg_cell_t side_z = hshg->grids[0].cells_side[2];)
+    const uint32_t size = hshg->cell_size;
+    const uint8_t grids_len = hshg->grids_len;
+
+    hshg = hshg_regrid_rect(hshg, side_x << 1 _2D(, side_y << 1)
+        _3D(, side_z << 1), size << 1);
+
+    assert(hshg);
+    assert_eq(hshg->grids_len, hshg_max_grids(side_x << 1 _2D(, side_y << 1)
+        _3D(, side_z << 1)));
+
+    check_regrid(expected);
+
+    hshg = hshg_regrid_rect(hshg, side_x _2D(, side_y) _3D(, side_z), size);
+
+    assert(hshg);
+    assert_eq(hshg->grids_len, grids_len);
+
+    check_regrid(expected);
+}
+
+
+void
+change_pos(unused struct hshg* _, struct hshg_entity* ent)
+{
+    --ent->x;
+_2D(++ent->y;)
+_3D(--ent->z;)
+
+    hshg_move(hshg);
+}
+
+
+void
+revert_pos(unused struct hshg* _, struct hshg_entity* ent)
+{
+    ent->x += 100;
+_2D(ent->y -= 100;)
+_3D(ent->z += 100;)
+
+    hshg_move(hshg);
+}
+
+
+#define _check_count(checks, _len)           \
+do                                           \
+{                                            \
+    int len = _len;                          \
+                                             \
+    assert_eq(obj_count, len);               \
+                                             \
+    for(int i = 0; i < len; ++i)             \
+    {                                        \
+        assert_eq(objs[i].count, checks[i]); \
+    }                                        \
+}                                            \
+while(0)
+
+
+#define check_count(checks) \
+_check_count(checks, sizeof(checks) / sizeof(checks[0]))
+
+
+int did_it;
+
+struct dis
+{
+    hshg_pos_t x;
+_2D(hshg_pos_t y;)
+_3D(hshg_pos_t z;)
+    hshg_pos_t r;
+    int del;
+};
+
+struct dis old_data;
+struct dis new_data;
+
+
+void
+upd_set(unused struct hshg* _, struct hshg_entity* ent)
+{
+    if(ent->x == old_data.x _2D( && ent->y == old_data.y)
+        _3D( && ent->z == old_data.z) && ent->r == old_data.r)
+    {
+        did_it = 1;
+
+        if(new_data.del)
+        {
+            ret_obj(ent->ref);
+
+            return hshg_remove(hshg);
+        }
+
+        ent->x = new_data.x;
+    _2D(ent->y = new_data.y;)
+    _3D(ent->z = new_data.z;)
+        ent->r = new_data.r;
+
+        if(old_data.x != new_data.x _2D( || old_data.y != new_data.y)
+            _3D( || old_data.z != new_data.z))
+        {
+            hshg_move(hshg);
+        }
+
+        if(old_data.r != new_data.r)
+        {
+            hshg_resize(hshg);
+        }
+    }
+}
+
+
+void
+upd_set_multithread(const struct hshg* h, struct hshg_entity* ent)
+{
+    if(ent->x == old_data.x _2D( && ent->y == old_data.y)
+        _3D( && ent->z == old_data.z) && ent->r == old_data.r)
+    {
+        did_it = 1;
+
+        if(new_data.del)
+        {
+            ret_obj(ent->ref);
+
+            hshg_remove_multithread(h, ent);
+
+            return;
+        }
+
+        ent->x = new_data.x;
+    _2D(ent->y = new_data.y;)
+    _3D(ent->z = new_data.z;)
+        ent->r = new_data.r;
+    }
+}
+
+
+void
+update_relink_multithread(void)
+{
+    hshg->const_update = upd_set_multithread;
+
+    run_threads(update_relink_thread);
+
+    check_cells();
+}
+
+
+int sets;
+
+
+/*
+ * Every other change goes through hshg_update_relink_multithread() instead.
+ */
 #define set(_old_data, _new_data)     \
 do                                    \
 {                                     \
@@ -306,7 +1386,14 @@ do                                    \
     new_data = _new_data;             \
     did_it = 0;                       \
                                       \
-    hshg_update(hshg);                \
+    if(++sets & 1)                    \
+    {                                 \
+        hshg_update(hshg);            \
+    }                                 \
+    else                              \
+    {                                 \
+        update_relink_multithread();  \
+    }                                 \
                                       \
     assert(did_it);                   \
                                       \
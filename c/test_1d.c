@@ -8,7 +8,7 @@
 void
 test(const hshg_cell_t side, const uint32_t size)
 {
-    hshg = hshg_create(side, size);
+    hshg = create(side, size);
 
     assert(hshg);
 
@@ -77,7 +77,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 2, 3, 3, 4, 2, 0, 2 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -93,6 +93,30 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 2, 3, 3, 4, 2, 1, 2, 1 }));
 
 
+    rebase();
+
+
+    sync_positions();
+
+
+    rebuild();
+
+
+    sleep_wake();
+
+
+    compact();
+
+
+    optimize_incremental_changes();
+
+
+    allocator();
+
+
+    regrid();
+
+
     hshg->update = upd;
 
     reset();
@@ -125,7 +149,14 @@ test(const hshg_cell_t side, const uint32_t size)
         check_count(((int[]){ 2, 3, 3, 4, 2, 1, 2, 1 }));
 
 
-        assert(!hshg_optimize(hshg));
+        if(i & 1)
+        {
+            optimize_incremental();
+        }
+        else
+        {
+            optimize();
+        }
 
         reset();
 
@@ -192,7 +223,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 1, 1, 1, 1, 1, 1, 1, 1 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -240,7 +271,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 1, 1 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -266,5 +297,8 @@ test(const hshg_cell_t side, const uint32_t size)
     query(1, 2, 1);
 
 
+    optimize_incremental();
+
+
     hshg_free(hshg);
 }
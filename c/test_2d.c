@@ -6,7 +6,7 @@
 void
 test(const hshg_cell_t side, const uint32_t size)
 {
-    hshg = hshg_create(side, size);
+    hshg = create(side, size);
 
     assert(hshg);
 
@@ -75,7 +75,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 2, 3, 3, 4, 2, 0, 2 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -91,6 +91,30 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 2, 3, 3, 4, 2, 1, 2, 1 }));
 
 
+    rebase();
+
+
+    sync_positions();
+
+
+    rebuild();
+
+
+    sleep_wake();
+
+
+    compact();
+
+
+    optimize_incremental_changes();
+
+
+    allocator();
+
+
+    regrid();
+
+
     hshg->update = upd;
 
     reset();
@@ -123,7 +147,14 @@ test(const hshg_cell_t side, const uint32_t size)
         check_count(((int[]){ 2, 3, 3, 4, 2, 1, 2, 1 }));
 
 
-        assert(!hshg_optimize(hshg));
+        if(i & 1)
+        {
+            optimize_incremental();
+        }
+        else
+        {
+            optimize();
+        }
 
         reset();
 
@@ -192,7 +223,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 1, 1, 1, 1, 1, 1, 1, 1 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -252,7 +283,7 @@ test(const hshg_cell_t side, const uint32_t size)
     assert_eq(objs[3].count, 1);
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -281,5 +312,8 @@ test(const hshg_cell_t side, const uint32_t size)
     query(0, 0, 13.99, 32, 0);
 
 
+    optimize_incremental();
+
+
     hshg_free(hshg);
 }
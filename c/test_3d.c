@@ -4,7 +4,7 @@
 void
 test(const hshg_cell_t side, const uint32_t size)
 {
-    hshg = hshg_create(side, size);
+    hshg = create(side, size);
 
     assert(hshg);
 
@@ -55,7 +55,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 1, 2, 2, 1, 0 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -80,7 +80,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 2, 3, 3, 1, 1, 2, 4 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -96,6 +96,30 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 3, 4, 3, 1, 1, 2, 4, 2 }));
 
 
+    rebase();
+
+
+    sync_positions();
+
+
+    rebuild();
+
+
+    sleep_wake();
+
+
+    compact();
+
+
+    optimize_incremental_changes();
+
+
+    allocator();
+
+
+    regrid();
+
+
     hshg->update = upd;
 
     reset();
@@ -114,7 +138,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 4, 5, 4, 1, 1, 3, 5, 3, 6 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -144,7 +168,14 @@ test(const hshg_cell_t side, const uint32_t size)
         check_count(((int[]){ 4, 5, 4, 1, 1, 3, 5, 3, 6 }));
 
 
-        assert(!hshg_optimize(hshg));
+        if(i & 1)
+        {
+            optimize_incremental();
+        }
+        else
+        {
+            optimize();
+        }
 
         reset();
 
@@ -227,7 +258,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 1, 1, 1, 1, 1, 1, 1, 1 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -264,7 +295,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 1, 1, 1, 1, 1, 1 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -305,7 +336,7 @@ test(const hshg_cell_t side, const uint32_t size)
     check_count(((int[]){ 1, 1, 1 }));
 
 
-    assert(!hshg_optimize(hshg));
+    optimize();
 
     assert_col();
 
@@ -328,5 +359,8 @@ test(const hshg_cell_t side, const uint32_t size)
     query(0, 0, 0, 0, 0, 0, 1);
 
 
+    optimize_incremental();
+
+
     hshg_free(hshg);
 }
@@ -0,0 +1,414 @@
+/*
+ * Compares collisions and queries against brute force, while entities keep
+ * moving, resizing, dying and being inserted again. Unlike test.c, entities
+ * have no user data, and all positions and radii are whole numbers, so that
+ * the same test also runs with HSHG_INTEGER. Build it with -DHSHG_D=1, 2 or 3.
+ */
+#define HSHG_UNIFORM
+#include "hshg.c"
+
+/*
+ * Like in test.c, checks stay on even if the HSHG is built without them.
+ */
+#undef NDEBUG
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define unused __attribute__((unused))
+
+#ifdef HSHG_STATIC_SIDE
+#define SIDE HSHG_STATIC_SIDE
+#define CELL_SIZE HSHG_STATIC_CELL_SIZE
+#else
+#define SIDE 32
+#define CELL_SIZE 4
+#endif
+
+#define NUM_ENT 256
+#define ROUNDS 24
+
+/* Positions start within [-SPAN, SPAN) on every axis */
+#define SPAN 400
+
+
+struct ent
+{
+    int64_t pos[HSHG_D];
+    int64_t r;
+    int alive;
+};
+
+struct ent ents[NUM_ENT];
+
+uint8_t seen[NUM_ENT][NUM_ENT];
+
+int col_num;
+int query_num;
+
+int64_t query_min[HSHG_D];
+int64_t query_max[HSHG_D];
+
+
+int64_t
+rand_range(const int64_t min, const int64_t max)
+{
+    return min + rand() % (max - min + 1);
+}
+
+
+int64_t
+rand_radius(void)
+{
+    /*
+     * Mostly small entities, with a few big enough to go to upper grids.
+     */
+    return rand() % 16 == 0 ? rand_range(16, 200) : rand_range(0, 6);
+}
+
+
+int
+overlap(const struct ent* const a, const struct ent* const b)
+{
+    for(int i = 0; i < HSHG_D; ++i)
+    {
+        const int64_t d = a->pos[i] - b->pos[i];
+
+        if((d < 0 ? -d : d) > a->r + b->r)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+int
+in_query(const struct ent* const e)
+{
+    for(int i = 0; i < HSHG_D; ++i)
+    {
+        if(e->pos[i] + e->r < query_min[i] || e->pos[i] - e->r > query_max[i])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+void
+check_entity(const struct hshg_entity* const entity)
+{
+    const struct ent* const e = ents + entity->ref;
+
+    assert(e->alive);
+    assert(e->pos[0] == (int64_t) entity->x);
+_2D(assert(e->pos[1] == (int64_t) entity->y);)
+_3D(assert(e->pos[2] == (int64_t) entity->z);)
+    assert(e->r == (int64_t) entity->r);
+}
+
+
+void
+col(unused const struct hshg* _, const struct hshg_entity* a,
+    const struct hshg_entity* b)
+{
+    check_entity(a);
+    check_entity(b);
+
+    if(!overlap(ents + a->ref, ents + b->ref))
+    {
+        return;
+    }
+
+    const hshg_entity_t lo = a->ref < b->ref ? a->ref : b->ref;
+    const hshg_entity_t hi = a->ref < b->ref ? b->ref : a->ref;
+
+    assert(!seen[lo][hi]);
+
+    seen[lo][hi] = 1;
+    ++col_num;
+}
+
+
+void
+query(unused const struct hshg* _, const struct hshg_entity* entity)
+{
+    check_entity(entity);
+
+    assert(in_query(ents + entity->ref));
+
+    ++query_num;
+}
+
+
+void
+upd(struct hshg* hshg, struct hshg_entity* entity)
+{
+    struct ent* const e = ents + entity->ref;
+
+    switch(rand() % 16)
+    {
+
+    case 0:
+    {
+        e->alive = 0;
+
+        hshg_remove(hshg);
+
+        return;
+    }
+
+    case 1:
+    {
+        e->r = rand_radius();
+        entity->r = e->r;
+
+        hshg_resize(hshg);
+
+        break;
+    }
+
+    default: break;
+
+    }
+
+    for(int i = 0; i < HSHG_D; ++i)
+    {
+        e->pos[i] += rand_range(-8, 8);
+    }
+
+    entity->x = e->pos[0];
+_2D(entity->y = e->pos[1];)
+_3D(entity->z = e->pos[2];)
+
+    hshg_move(hshg);
+}
+
+
+void
+insert(struct hshg* const hshg, const hshg_entity_t ref)
+{
+    struct ent* const e = ents + ref;
+
+    e->alive = 1;
+    e->r = rand_radius();
+
+    for(int i = 0; i < HSHG_D; ++i)
+    {
+        e->pos[i] = rand_range(-SPAN, SPAN - 1);
+    }
+
+    assert(!hshg_insert(hshg, e->pos[0] _2D(, e->pos[1]) _3D(, e->pos[2]),
+        e->r, ref));
+}
+
+
+void
+check_collide(struct hshg* const hshg)
+{
+    memset(seen, 0, sizeof(seen));
+    col_num = 0;
+
+    hshg_collide(hshg);
+
+    int expected = 0;
+
+    for(int i = 0; i < NUM_ENT; ++i)
+    {
+        for(int j = i + 1; j < NUM_ENT; ++j)
+        {
+            if(ents[i].alive && ents[j].alive && overlap(ents + i, ents + j))
+            {
+                assert(seen[i][j]);
+
+                ++expected;
+            }
+        }
+    }
+
+    assert(col_num == expected);
+}
+
+
+void
+check_query(struct hshg* const hshg)
+{
+    query_num = 0;
+
+    hshg_query(hshg, query_min[0] _2D(, query_min[1]) _3D(, query_min[2]),
+        query_max[0] _2D(, query_max[1]) _3D(, query_max[2]));
+
+    int expected = 0;
+
+    for(int i = 0; i < NUM_ENT; ++i)
+    {
+        expected += ents[i].alive && in_query(ents + i);
+    }
+
+    assert(query_num == expected);
+}
+
+
+void
+check_queries(struct hshg* const hshg)
+{
+    for(int q = 0; q < 8; ++q)
+    {
+        for(int i = 0; i < HSHG_D; ++i)
+        {
+            query_min[i] = rand_range(-SPAN * 2, SPAN * 2);
+            query_max[i] = query_min[i] + rand_range(0, SPAN);
+        }
+
+        check_query(hshg);
+    }
+}
+
+
+void
+random_world(void)
+{
+    struct hshg* const hshg = hshg_create(SIDE, CELL_SIZE);
+
+    assert(hshg);
+
+    hshg->update = upd;
+    hshg->collide = col;
+    hshg->query = query;
+
+    for(hshg_entity_t i = 0; i < NUM_ENT; ++i)
+    {
+        insert(hshg, i);
+    }
+
+    for(int round = 0; round < ROUNDS; ++round)
+    {
+        hshg_update(hshg);
+
+        if(round % 4 == 1)
+        {
+            assert(!hshg_optimize(hshg));
+        }
+
+        for(hshg_entity_t i = 0; i < NUM_ENT; ++i)
+        {
+            if(!ents[i].alive && rand() % 2)
+            {
+                insert(hshg, i);
+            }
+        }
+
+        check_collide(hshg);
+        check_queries(hshg);
+    }
+
+    hshg_free(hshg);
+}
+
+
+#ifdef HSHG_INTEGER
+
+const int64_t edges[] =
+{
+    INT32_MIN, INT32_MIN + 1, INT32_MIN + 2, -1, 0, 1,
+    INT32_MAX - 2, INT32_MAX - 1, INT32_MAX
+};
+
+#define EDGES_LEN (sizeof(edges) / sizeof(edges[0]))
+
+const int64_t edge_radii[] =
+{
+    0, 1, 2, 1 << 20, INT32_MAX / 2, INT32_MAX
+};
+
+#define EDGE_RADII_LEN (sizeof(edge_radii) / sizeof(edge_radii[0]))
+
+
+/*
+ * Positions and radii all over the range of int32_t, including ones whose
+ * boxes reach past it. Cells must be found without overflowing anything, and
+ * queries and collisions must still be exact.
+ */
+void
+int32_edges(void)
+{
+    struct hshg* const hshg = hshg_create(SIDE, CELL_SIZE);
+
+    assert(hshg);
+
+    hshg->collide = col;
+    hshg->query = query;
+
+    for(hshg_entity_t i = 0; i < NUM_ENT; ++i)
+    {
+        struct ent* const e = ents + i;
+
+        e->alive = 1;
+        e->r = edge_radii[rand() % EDGE_RADII_LEN];
+
+        for(int j = 0; j < HSHG_D; ++j)
+        {
+            e->pos[j] = edges[rand() % EDGES_LEN];
+        }
+
+        assert(!hshg_insert(hshg, e->pos[0] _2D(, e->pos[1])
+            _3D(, e->pos[2]), e->r, i));
+    }
+
+    for(int round = 0; round < 2; ++round)
+    {
+        check_collide(hshg);
+
+        for(int i = 0; i < HSHG_D; ++i)
+        {
+            query_min[i] = INT32_MIN;
+            query_max[i] = INT32_MAX;
+        }
+
+        check_query(hshg);
+        assert(query_num == NUM_ENT);
+
+        for(int q = 0; q < 64; ++q)
+        {
+            for(int i = 0; i < HSHG_D; ++i)
+            {
+                const int64_t a = edges[rand() % EDGES_LEN];
+                const int64_t b = edges[rand() % EDGES_LEN];
+
+                query_min[i] = a < b ? a : b;
+                query_max[i] = a < b ? b : a;
+            }
+
+            check_query(hshg);
+        }
+
+        assert(!hshg_optimize(hshg));
+    }
+
+    hshg_free(hshg);
+}
+
+#endif /* HSHG_INTEGER */
+
+
+int
+main()
+{
+    srand(1);
+
+    random_world();
+
+#ifdef HSHG_INTEGER
+    int32_edges();
+#endif
+
+    puts("pass");
+
+    return 0;
+}
@@ -20,6 +20,16 @@ malloc(size_t len)
 }
 
 
+static void*
+aligned_alloc(size_t align, size_t len)
+{
+    malloc_base = (uint8_t*)
+        (((uintptr_t) malloc_base + align - 1) & ~(uintptr_t)(align - 1));
+
+    return malloc(len);
+}
+
+
 static void
 free(void* ptr)
 {
@@ -68,6 +78,20 @@ memcpy(void* dest, const void* src, size_t n)
 }
 
 
+static void*
+memset(void* dest, int c, size_t n)
+{
+    uint8_t* _dest = dest;
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        _dest[i] = c;
+    }
+
+    return dest;
+}
+
+
 #define HSHG_NDEBUG
 #define HSHG_UNIFORM
 